@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+
+# Benchmark the P2G transfer algorithms on a set of particle files.
+#
+# Every (particle file, algorithm) pair runs the sample headless with `-flag p2g-only` and
+# `-trace`, so the P2G timings come from the profiler trace rather than from stdout. The first
+# warm-up iterations are dropped, the remaining ones are summarized.
+#
+# Example, after running generate_particles.py in this directory:
+#   ./benchmark_p2g.py --exe ../build/bin/p2g-scatter --csv p2g.csv --json p2g.json \
+#       fixedsize-ppc*.dat fixedppc-n*.dat fixedn-ppc*.dat
+
+import argparse
+import csv
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from generate_particles import scene_template
+
+algorithms = ['scatter', 'gather', 'scatter_reduce', 'scatter_colored']
+default_algorithms = ['scatter', 'gather', 'scatter_reduce']  # Available on both backends
+
+
+def read_particle_count(particle_file):
+    with open(particle_file, 'rb') as fin:
+        magic = fin.read(8)
+        if magic.startswith(b'P2GPART'):
+            # Binary header: magic[8], version, flags (uint32), count (uint64)
+            fin.seek(16)
+            return int.from_bytes(fin.read(8), 'little')
+    with open(particle_file, 'r') as fin:
+        return int(fin.readline())
+
+
+def particle_file_for(scene_file):
+    with open(scene_file, 'r') as fin:
+        for line in fin:
+            tag, _, value = line.strip().partition(':')
+            if tag == 'file' and value.strip().endswith(('.dat', '.p2g')):
+                return os.path.join(os.path.dirname(scene_file), value.strip())
+    raise RuntimeError('No particle file in %s' % scene_file)
+
+
+def scene_for(particle_file):
+    # The sample runs in the scene's directory and finds the particle file by name there, so
+    # scenes live next to the particle files
+    base, ext = os.path.splitext(particle_file)
+    if ext == '.scn':
+        return particle_file
+    scene_file = base + '.scn'
+    if not os.path.exists(scene_file):
+        with open(scene_file, 'w') as fout:
+            fout.write(scene_template.replace('{{ filename }}', os.path.basename(particle_file)))
+    return scene_file
+
+
+def percentile(sorted_values, p):
+    return sorted_values[int(p * (len(sorted_values) - 1) + 0.5)]
+
+
+def run_case(args, scene_file, algorithm):
+    with tempfile.TemporaryDirectory() as tmpdir:
+        trace_file = os.path.join(tmpdir, 'trace.json')
+        command = [
+            args.exe,
+            '-headless', '1',
+            '-in', os.path.basename(scene_file),
+            '-backend', args.backend,
+            '-p2g-algorithm', algorithm,
+            '-flag', 'p2g-only',
+            '-frame-limit', str(args.warmup + args.iterations),
+            '-trace', trace_file,
+        ]
+        if args.threads:
+            command += ['-threads', str(args.threads)]
+        # Run next to the scene so that it and the particle files it names are found by name,
+        # wherever they are
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                universal_newlines=True,
+                                cwd=os.path.dirname(os.path.abspath(scene_file)))
+        if result.returncode != 0 or not os.path.exists(trace_file):
+            print(result.stdout)
+            raise RuntimeError('%s failed with exit code %d' % (' '.join(command), result.returncode))
+
+        with open(trace_file, 'r') as fin:
+            events = json.load(fin)['traceEvents']
+
+    p2g_events = sorted([e for e in events if e['name'] == 'P2G'], key=lambda e: e['args']['iteration'])
+    durations = sorted([e['dur'] / 1000.0 for e in p2g_events[args.warmup:args.warmup + args.iterations]])  # in ms
+    if not durations:
+        raise RuntimeError('No measured P2G iterations for %s' % scene_file)
+
+    peak_memory = re.search(r'Peak memory: ([0-9.]+) MB', result.stdout)
+    return durations, float(peak_memory.group(1)) if peak_memory else None
+
+
+def summarize(particle_file, algorithm, particle_count, durations, peak_memory):
+    mean = sum(durations) / len(durations)
+    return {
+        'file': os.path.basename(particle_file),
+        'algorithm': algorithm,
+        'particles': particle_count,
+        'iterations': len(durations),
+        'min_ms': durations[0],
+        'mean_ms': mean,
+        'p50_ms': percentile(durations, 0.5),
+        'p90_ms': percentile(durations, 0.9),
+        'p99_ms': percentile(durations, 0.99),
+        'max_ms': durations[-1],
+        'particles_per_second': particle_count / (percentile(durations, 0.5) * 1e-3),
+        'peak_memory_mb': peak_memory,
+    }
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Benchmark P2G algorithms on particle files')
+    parser.add_argument('files', nargs='+', help='particle files (.dat, .p2g) or scenes (.scn)')
+    parser.add_argument('--exe', required=True, help='path to the sample executable')
+    parser.add_argument('--algorithms', nargs='+', default=default_algorithms, choices=algorithms)
+    parser.add_argument('--backend', default='gpu', choices=['gpu', 'cpu'])
+    parser.add_argument('--threads', type=int, default=0, help='CPU backend threads')
+    parser.add_argument('--warmup', type=int, default=10, help='warm-up iterations to drop')
+    parser.add_argument('--iterations', type=int, default=100, help='measured iterations')
+    parser.add_argument('--csv', help='write results as CSV')
+    parser.add_argument('--json', help='write results as JSON')
+    args = parser.parse_args()
+    args.exe = os.path.abspath(args.exe)
+
+    results = []
+    for particle_file in args.files:
+        scene_file = scene_for(particle_file)
+        if particle_file.endswith('.scn'):
+            particle_file = particle_file_for(scene_file)
+        particle_count = read_particle_count(particle_file)
+        for algorithm in args.algorithms:
+            print('%s %s... ' % (os.path.basename(particle_file), algorithm), end='')
+            sys.stdout.flush()
+            durations, peak_memory = run_case(args, scene_file, algorithm)
+            row = summarize(particle_file, algorithm, particle_count, durations, peak_memory)
+            results.append(row)
+            print('p50 %.3f ms, %.3e particles/s' % (row['p50_ms'], row['particles_per_second']))
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as fout:
+            writer = csv.DictWriter(fout, fieldnames=list(results[0].keys()))
+            writer.writeheader()
+            writer.writerows(results)
+
+    if args.json:
+        with open(args.json, 'w') as fout:
+            json.dump({
+                'backend': args.backend,
+                'warmup': args.warmup,
+                'iterations': args.iterations,
+                'results': results,
+            }, fout, indent=2)
@@ -1,78 +1,11 @@
 #!/usr/bin/env python3
 
-scene_template = """
-points
-  file: {{ filename }}
-  frame: 0
-  mat: 0
-
-model
-  file: ground.obj
-  scale: 1.0
-  offset: <0,5,0>
-  mat: 1
-
-render
-  width: 800
-  height: 600
-  samples: 32
-  backclr: <.1, .2, .4>
-  envmap: sky.png
-  outfile: img%04d.png
-
-volume
-  scale: 2.0
-  steps: <.25, 16, .25>
-  extinct: <-1, 1.1, 0.0>
-  range: <0, -1, 3>
-  cutoff: <0.005, 0.001, 0.0>
-  smooth: 1
-  smoothp: <1.0, -0.2, 0.0>
-
-camera
-  angs: <5, 20, 0>
-  target: <30, 20, 30>
-  dist: 200
-  fov: 50
-
-light
-  angs: <-186, 128, 0>
-  target: <1125, 110, 1110>
-  dist: 2000
-
-material
-  lightwid: 0.9
-  shwid: 0.1
-  shbias: 0.5
-  ambient: <0.1, 0.15, 0.15>
-  diffuse: <0.1, 0.12, 0.18>
-  spec: <1.2, 1.2, 1.2>
-  spow: 200
-  env: <0,0,0>
-  reflwid: 0.2
-  reflbias: 0.5
-  reflcolor: <0.3, 0.3, 0.3>
-  refrwid: 0.05
-  refrcolor: <0.2, 0.2, 0.25>
-  refrior: 1.33
-  reframt: 0.8
-  refroffs: 100
-  refrbias: 0.5
-
-material
-  lightwid: 0.9
-  shwid: 0.1
-  shbias: 0.5
-  ambient: <0.1, 0.1, 0.1>
-  diffuse: <1.0, 1.0, 1.0>
-  spec: <0.0, 0.0, 0.0>
-  spow: 20
-  env: <0,0,0>
-  reflwid: 0.0
-  reflbias: 0.5
-  reflcolor: <0.5, 0.5, 0.5>
-  refrwid: 0.0
-"""
+import os
+
+# Scene written next to every particle file, shared with src/tools/generate_particles.cpp
+template_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'scene_template.scn')
+with open(template_path, 'r') as fin:
+    scene_template = fin.read()
 
 
 def rangef(start, stop, step):
@@ -0,0 +1,124 @@
+#include "brick_pool.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+static char *allocAligned(size_t bytes) {
+#ifdef _WIN32
+    return (char *)_aligned_malloc(bytes, BRICK_POOL_ALIGNMENT);
+#else
+    void *ptr = 0;
+    if (posix_memalign(&ptr, BRICK_POOL_ALIGNMENT, bytes) != 0)
+        return 0;
+    return (char *)ptr;
+#endif
+}
+
+static void freeAligned(char *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+BrickPool::BrickPool() {
+    mArena = 0;
+    mArenaBytes = 0;
+    mBrickNodes = 0;
+    mChunk = BRICK_POOL_CHUNK;
+    mCount = 0;
+    mCapacity = 0;
+    mHighWater = 0;
+    mGrowths = 0;
+}
+
+BrickPool::~BrickPool() { Free(); }
+
+void BrickPool::Configure(int channels, int brickNodes) {
+    if (channels == (int)mBytes.size() && brickNodes == mBrickNodes)
+        return;
+    Free();
+    mBytes.resize(channels, (int)sizeof(float));
+    mOffsets.assign(channels, 0);
+    mBrickNodes = brickNodes;
+    mGrowths = 0;
+}
+
+void BrickPool::SetChannelBytes(int chan, int bytes) {
+    if (mBytes[chan] == bytes)
+        return;
+    Free();
+    mBytes[chan] = bytes;
+}
+
+void BrickPool::SetChunk(int chunkBricks) { mChunk = std::max(chunkBricks, 1); }
+
+bool BrickPool::allocate(int capacity, bool keep) {
+    const int channels = (int)mBytes.size();
+    std::vector<size_t> offsets(channels);
+    size_t bytes = 0;
+    for (int c = 0; c < channels; c++) {
+        offsets[c] = bytes;
+        size_t size = (size_t)capacity * mBrickNodes * mBytes[c];
+        bytes += (size + BRICK_POOL_ALIGNMENT - 1) / BRICK_POOL_ALIGNMENT * BRICK_POOL_ALIGNMENT;
+    }
+    char *arena = allocAligned(bytes);
+    if (!arena)
+        return false;
+
+    if (mArena) {
+        if (keep) {
+            for (int c = 0; c < channels; c++)
+                memcpy(arena + offsets[c], mArena + mOffsets[c],
+                       (size_t)mCount * mBrickNodes * mBytes[c]);
+        }
+        freeAligned(mArena);
+    }
+    mArena = arena;
+    mArenaBytes = bytes;
+    mOffsets.swap(offsets);
+    mCapacity = capacity;
+    mGrowths++;
+    return true;
+}
+
+bool BrickPool::Resize(int numBricks) {
+    if (numBricks > mCapacity) {
+        int capacity = (int)(((size_t)numBricks + mChunk - 1) / mChunk * mChunk);
+        if (!allocate(capacity, false))
+            return false;
+    }
+    mCount = numBricks;
+    mHighWater = std::max(mHighWater, mCount);
+    return true;
+}
+
+void BrickPool::Trim() {
+    int capacity = (int)(((size_t)mCount + mChunk - 1) / mChunk * mChunk);
+    mHighWater = mCount;
+    if (capacity >= mCapacity)
+        return;
+    if (capacity == 0) {
+        int growths = mGrowths;
+        Free();
+        mGrowths = growths;
+        return;
+    }
+    allocate(capacity, true);
+}
+
+void BrickPool::Free() {
+    if (mArena)
+        freeAligned(mArena);
+    mArena = 0;
+    mArenaBytes = 0;
+    mCount = 0;
+    mCapacity = 0;
+    mHighWater = 0;
+}
@@ -0,0 +1,66 @@
+#ifndef BRICK_POOL_H
+#define BRICK_POOL_H
+
+#include <stddef.h>
+#include <vector>
+
+#define BRICK_POOL_ALIGNMENT 64 // Bytes, start of every channel array
+#define BRICK_POOL_CHUNK 1024   // Default bricks per chunk, the 32x32x1 GVDB atlas default
+
+// Brick payloads of a SparseGrid, the CPU counterpart of the GVDB atlas. All channels live in a
+// single aligned arena with room for a whole number of chunks of bricks, each channel padded to
+// the capacity, so channel c of brick b stays at getChannel(c)[b * brickNodes + node]. Bricks
+// use slots 0 .. count - 1: activating or releasing one only moves the count, and the arena
+// changes only when the count passes the capacity. It then grows to the next whole chunk
+// without copying, since the grid clears its channels after every topology change, and keeps
+// its size (the high-water mark) until Trim. Channels hold 4-byte floats unless configured
+// with a narrower element size for reduced-precision storage.
+class BrickPool {
+  public:
+    BrickPool();
+    ~BrickPool();
+
+    // Channels and nodes per brick, releases the arena when they change
+    void Configure(int channels, int brickNodes);
+    // Bytes per node of a channel, releases the arena when it changes
+    void SetChannelBytes(int chan, int bytes);
+    // Bricks per growth step
+    void SetChunk(int chunkBricks);
+
+    // Set the bricks in use. Payloads are undefined after the arena grows. Returns false, keeping
+    // the previous bricks, when the arena cannot grow.
+    bool Resize(int numBricks);
+    // Shrink the arena to the chunks holding the bricks in use, keeping their payloads
+    void Trim();
+    void Free();
+
+    void *getChannelData(int chan) { return mArena ? mArena + mOffsets[chan] : 0; }
+    float *getChannel(int chan) { return (float *)getChannelData(chan); } // 4-byte channels
+    int getChannelBytes(int chan) const { return mBytes[chan]; }
+
+    int getNumBricks() const { return mCount; }
+    int getCapacity() const { return mCapacity; }
+    int getHighWater() const { return mHighWater; } // Most bricks in use since the last Trim
+    int getNumGrowths() const { return mGrowths; }  // Arena allocations since Configure
+    size_t getMemoryUsage() const { return mArenaBytes; }
+
+  private:
+    BrickPool(const BrickPool &);
+    BrickPool &operator=(const BrickPool &);
+
+    // Allocate room for `capacity` bricks, copying the payloads of the bricks in use if `keep`
+    bool allocate(int capacity, bool keep);
+
+    char *mArena;
+    size_t mArenaBytes;
+    std::vector<int> mBytes;      // Per channel, bytes per node
+    std::vector<size_t> mOffsets; // Per channel, bytes from the arena start
+    int mBrickNodes;
+    int mChunk;
+    int mCount;
+    int mCapacity;
+    int mHighWater;
+    int mGrowths;
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include "bspline_kernels.h"
+
+#include "bspline_kernels.inl"
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// Defined by the instruction set files, 0 when the compiler did not build them
+const BSplineKernels *getBSplineKernelsSSE4();
+const BSplineKernels *getBSplineKernelsAVX2();
+const BSplineKernels *getBSplineKernelsAVX512();
+
+static const BSplineKernels scalarKernels = {computeStencils<VecScalar>,
+                                             computeP2GTerms<VecScalar>};
+
+static bool cpuSupports(int level) {
+    if (level == SIMD_SCALAR)
+        return true;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    switch (level) {
+    case SIMD_SSE4:
+        return __builtin_cpu_supports("sse4.1");
+    case SIMD_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    }
+#elif defined(_MSC_VER) && defined(_M_X64)
+    int info[4];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    unsigned long long xcr0 = (info[2] & (1 << 27)) ? _xgetbv(0) : 0; // OS saves AVX state
+    __cpuidex(info, 7, 0);
+    switch (level) {
+    case SIMD_SSE4:
+        return sse41;
+    case SIMD_AVX2:
+        return (info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6;
+    case SIMD_AVX512:
+        return (info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+    }
+#endif
+    return false;
+}
+
+static const BSplineKernels *compiledKernels(int level) {
+    switch (level) {
+    case SIMD_SSE4:
+        return getBSplineKernelsSSE4();
+    case SIMD_AVX2:
+        return getBSplineKernelsAVX2();
+    case SIMD_AVX512:
+        return getBSplineKernelsAVX512();
+    }
+    return &scalarKernels;
+}
+
+int getBestSimdLevel() {
+    static int best = -1;
+    if (best < 0) {
+        best = SIMD_SCALAR;
+        for (int level = SIMD_LEVELS - 1; level > SIMD_SCALAR; level--) {
+            if (compiledKernels(level) && cpuSupports(level)) {
+                best = level;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+const char *getSimdName(int level) {
+    static const char *names[SIMD_LEVELS] = {"scalar", "sse4", "avx2", "avx512"};
+    return names[std::min(std::max(level, 0), SIMD_LEVELS - 1)];
+}
+
+const BSplineKernels &getBSplineKernels(int level) {
+    // A lower level may be missing from the build while a higher one is present
+    for (level = std::min(level, getBestSimdLevel()); level > SIMD_SCALAR; level--) {
+        if (compiledKernels(level) && cpuSupports(level))
+            return *compiledKernels(level);
+    }
+    return scalarKernels;
+}
+
+static float relativeDifference(const float *a, const float *b, int count) {
+    float diff = 0.0f;
+    for (int i = 0; i < count; i++)
+        diff = std::max(diff, std::fabs(a[i] - b[i]) / std::max(1.0f, std::fabs(b[i])));
+    return diff;
+}
+
+float CompareBSplineKernels(int level) {
+    const BSplineKernels &kernels = getBSplineKernels(level);
+
+    // Particles with random positions, velocities, slightly deformed F and small C
+    const int count = 1000;
+    std::vector<float> data(count * 25);
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < data.size(); i++) {
+        seed = seed * 1664525u + 1013904223u;
+        data[i] = (seed >> 8) * (1.0f / 16777216.0f); // [0, 1)
+    }
+    const float *pos[3], *vel[3], *def[9], *aff[9];
+    for (int a = 0; a < 3; a++) {
+        float *p = &data[a * count];
+        float *v = &data[(3 + a) * count];
+        for (int i = 0; i < count; i++) {
+            p[i] = p[i] * 256.0f;
+            v[i] = v[i] * 2.0f - 1.0f;
+        }
+        pos[a] = p;
+        vel[a] = v;
+    }
+    for (int k = 0; k < 9; k++) {
+        float *F = &data[(6 + k) * count];
+        float *C = &data[(15 + k) * count];
+        for (int i = 0; i < count; i++) {
+            F[i] = (k % 4 == 0 ? 1.0f : 0.0f) + (F[i] - 0.5f) * 0.2f;
+            C[i] = (C[i] - 0.5f) * 10.0f;
+        }
+        def[k] = F;
+        aff[k] = C;
+    }
+    float *mass = &data[24 * count];
+
+    P2GTermsParams params;
+    for (int a = 0; a < 3; a++)
+        params.vel[a] = vel[a];
+    for (int k = 0; k < 9; k++) {
+        params.def[k] = def[k];
+        params.aff[k] = aff[k];
+    }
+    params.mass = mass;
+    params.dx = 0.01f;
+    params.mu = 1.0e5f / 2.6f;
+    params.lambda = 1.0e5f * 0.3f / (1.3f * 0.4f);
+    params.particleVolume = 1.0e-6f;
+
+    // Both contiguous and indexed batches, with a partial batch at the end
+    std::vector<int> indices(count);
+    for (int i = 0; i < count; i++)
+        indices[i] = count - 1 - i;
+
+    float diff = 0.0f;
+    for (int indexed = 0; indexed < 2; indexed++) {
+        for (int first = 0; first < count; first += STENCIL_BATCH) {
+            int n = std::min(STENCIL_BATCH, count - first);
+            const int *idx = indexed ? &indices[first] : 0;
+            StencilBatch stencils, reference;
+            P2GTermsBatch terms, referenceTerms;
+            kernels.ComputeStencils(pos, idx, first, n, stencils);
+            scalarKernels.ComputeStencils(pos, idx, first, n, reference);
+            kernels.ComputeP2GTerms(params, idx, first, n, stencils.fx, terms);
+            scalarKernels.ComputeP2GTerms(params, idx, first, n, reference.fx, referenceTerms);
+
+            for (int a = 0; a < 3; a++) {
+                for (int lane = 0; lane < n; lane++) {
+                    if (stencils.base[a][lane] != reference.base[a][lane])
+                        return FLT_MAX;
+                }
+                diff = std::max(diff, relativeDifference(stencils.fx[a], reference.fx[a], n));
+                for (int node = 0; node < 3; node++) {
+                    diff = std::max(
+                        diff, relativeDifference(stencils.w[a][node], reference.w[a][node], n));
+                    diff = std::max(
+                        diff, relativeDifference(stencils.dw[a][node], reference.dw[a][node], n));
+                }
+                diff = std::max(diff, relativeDifference(terms.momentum[a],
+                                                         referenceTerms.momentum[a], n));
+            }
+            diff = std::max(diff, relativeDifference(terms.mass, referenceTerms.mass, n));
+            for (int k = 0; k < 9; k++) {
+                diff = std::max(diff, relativeDifference(terms.affine[k],
+                                                         referenceTerms.affine[k], n));
+                diff = std::max(diff, relativeDifference(terms.stress[k],
+                                                         referenceTerms.stress[k], n));
+            }
+        }
+    }
+    return diff;
+}
@@ -0,0 +1,115 @@
+#ifndef BSPLINE_KERNELS_H
+#define BSPLINE_KERNELS_H
+
+// Instruction sets of the B-spline kernels, in increasing order
+#define SIMD_SCALAR 0
+#define SIMD_SSE4 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+#define SIMD_LEVELS 4
+
+// Particles per kernel call, a multiple of every vector width
+#define STENCIL_BATCH 16
+
+// B-spline stencils of Size nodes per axis for a batch of particles, lane = particle in the batch
+template <int Size> struct BSplineStencils {
+    int base[3][STENCIL_BATCH];       // Grid index of the first stencil node
+    float fx[3][STENCIL_BATCH];       // Position relative to base
+    float w[3][Size][STENCIL_BATCH];  // w[axis][node]
+    float dw[3][Size][STENCIL_BATCH]; // dw/dx[axis][node] in grid units
+};
+
+// Quadratic stencils, the ones computed by BSplineKernels
+typedef BSplineStencils<3> StencilBatch;
+
+// B-spline of the given order (1 linear, 2 quadratic, 3 cubic). A particle at x (grid units)
+// has stencil nodes base .. base + SIZE - 1, base = floor(x - shift()), fx = x - base.
+// affineScale() * dx^-2 is the APIC D^-1, 0 when D is not constant (linear).
+template <int Order> struct BSpline;
+
+template <> struct BSpline<1> {
+    static constexpr int SIZE = 2;
+    static constexpr float shift() { return 0.0f; }
+    static constexpr float affineScale() { return 0.0f; }
+    static void weights(float fx, float *w, float *dw) {
+        w[0] = 1.0f - fx;
+        w[1] = fx;
+        dw[0] = -1.0f;
+        dw[1] = 1.0f;
+    }
+};
+
+template <> struct BSpline<2> {
+    static constexpr int SIZE = 3;
+    static constexpr float shift() { return 0.5f; }
+    static constexpr float affineScale() { return 4.0f; }
+    static void weights(float fx, float *w, float *dw) {
+        w[0] = 0.5f * (1.5f - fx) * (1.5f - fx);
+        w[1] = 0.75f - (fx - 1.0f) * (fx - 1.0f);
+        w[2] = 0.5f * (fx - 0.5f) * (fx - 0.5f);
+        dw[0] = fx - 1.5f;
+        dw[1] = -2.0f * (fx - 1.0f);
+        dw[2] = fx - 0.5f;
+    }
+};
+
+template <> struct BSpline<3> {
+    static constexpr int SIZE = 4;
+    static constexpr float shift() { return 1.0f; }
+    static constexpr float affineScale() { return 3.0f; }
+    static void weights(float fx, float *w, float *dw) {
+        // Node distances fx, fx - 1, 2 - fx, 3 - fx with fx in [1, 2)
+        float d1 = fx - 1.0f, d2 = 2.0f - fx;
+        w[0] = d2 * d2 * d2 * (1.0f / 6.0f);
+        w[1] = 0.5f * d1 * d1 * d1 - d1 * d1 + (2.0f / 3.0f);
+        w[2] = 0.5f * d2 * d2 * d2 - d2 * d2 + (2.0f / 3.0f);
+        w[3] = d1 * d1 * d1 * (1.0f / 6.0f);
+        dw[0] = -0.5f * d2 * d2;
+        dw[1] = 1.5f * d1 * d1 - 2.0f * d1;
+        dw[2] = -(1.5f * d2 * d2 - 2.0f * d2);
+        dw[3] = 0.5f * d1 * d1;
+    }
+};
+
+// Per-particle P2G terms, so that a node at stencil offset (i, j, k) with weight w and weight
+// derivatives g (grid units) receives
+//   mass     w * mass
+//   momentum w * (momentum[a] + affine[a][0] * i + affine[a][1] * j + affine[a][2] * k),
+//            which is the APIC momentum m * (v + C * (x_i - x_p))
+//   force    stress[a][0] * g[0] + stress[a][1] * g[1] + stress[a][2] * g[2]
+struct P2GTermsBatch {
+    float mass[STENCIL_BATCH];
+    float momentum[3][STENCIL_BATCH]; // m * (v - C * fx * dx)
+    float affine[9][STENCIL_BATCH];   // m * C * dx
+    float stress[9][STENCIL_BATCH];   // -volume * Kirchhoff stress / dx
+};
+
+// Particle streams and material constants read by ComputeP2GTerms
+struct P2GTermsParams {
+    const float *vel[3], *def[9], *aff[9], *mass;
+    float dx, mu, lambda, particleVolume;
+};
+
+// Kernels of one instruction set. Both read particles first .. first + count - 1, or
+// indices[0 .. count - 1] when indices is set; count is at most STENCIL_BATCH.
+struct BSplineKernels {
+    void (*ComputeStencils)(const float *const pos[3], const int *indices, int first, int count,
+                            StencilBatch &out);
+    // Neo-Hookean stress and APIC terms, using the fx of stencils computed for the same
+    // particles with any order
+    void (*ComputeP2GTerms)(const P2GTermsParams &params, const int *indices, int first,
+                            int count, const float (*fx)[STENCIL_BATCH], P2GTermsBatch &out);
+};
+
+// Highest instruction set supported by the compiler and the running CPU
+int getBestSimdLevel();
+const char *getSimdName(int level);
+
+// Kernels of the given level, clamped to getBestSimdLevel()
+const BSplineKernels &getBSplineKernels(int level);
+
+// Largest relative difference between the kernels of a level and the scalar reference over
+// a fixed set of particles, 0 when they match bit for bit as every level should
+float CompareBSplineKernels(int level);
+
+#endif
@@ -0,0 +1,127 @@
+// Body of the B-spline kernels, included once per instruction set by bspline_kernels_*.cpp.
+// The including file defines a vector type V with the same static members as VecScalar and
+// instantiates computeStencils<V> and computeP2GTerms<V>. Everything is in an anonymous
+// namespace, so instantiations compiled with different instruction set flags never merge.
+//
+// The kernels use separate multiplies and adds in the order of the scalar code (no FMA), so
+// every instruction set gives the scalar results up to the std::log of the stress.
+
+#include <cmath>
+
+namespace {
+
+struct VecScalar {
+    typedef float F;
+    enum { WIDTH = 1 };
+    static F load(const float *p) { return *p; }
+    static F gather(const float *base, const int *indices) { return base[*indices]; }
+    static void store(float *p, F a) { *p = a; }
+    static void storeInt(int *p, F a) { *p = (int)a; }
+    static F set1(float x) { return x; }
+    static F add(F a, F b) { return a + b; }
+    static F sub(F a, F b) { return a - b; }
+    static F mul(F a, F b) { return a * b; }
+    static F max(F a, F b) { return a < b ? b : a; }
+    static F floor(F a) { return std::floor(a); }
+    static F log(F a) { return std::log(a); }
+};
+
+template <class V>
+inline typename V::F loadLanes(const float *stream, const int *indices, int first, int lane) {
+    return indices ? V::gather(stream, indices + lane) : V::load(stream + first + lane);
+}
+
+template <class V>
+inline void stencilLanes(const float *const pos[3], const int *indices, int first, int lane,
+                         StencilBatch &out) {
+    typedef typename V::F F;
+    const F half = V::set1(0.5f), one = V::set1(1.0f), oneHalf = V::set1(1.5f);
+    for (int a = 0; a < 3; a++) {
+        F x = loadLanes<V>(pos[a], indices, first, lane);
+        F base = V::floor(V::sub(x, half));
+        F fx = V::sub(x, base);
+        V::storeInt(&out.base[a][lane], base);
+        V::store(&out.fx[a][lane], fx);
+
+        F t0 = V::sub(oneHalf, fx);
+        F t1 = V::sub(fx, one);
+        F t2 = V::sub(fx, half);
+        V::store(&out.w[a][0][lane], V::mul(V::mul(half, t0), t0));
+        V::store(&out.w[a][1][lane], V::sub(V::set1(0.75f), V::mul(t1, t1)));
+        V::store(&out.w[a][2][lane], V::mul(V::mul(half, t2), t2));
+        V::store(&out.dw[a][0][lane], V::sub(fx, oneHalf));
+        V::store(&out.dw[a][1][lane], V::mul(V::set1(-2.0f), t1));
+        V::store(&out.dw[a][2][lane], t2);
+    }
+}
+
+template <class V>
+inline void p2gTermsLanes(const P2GTermsParams &params, const int *indices, int first, int lane,
+                          const float (*stencilFx)[STENCIL_BATCH], P2GTermsBatch &out) {
+    typedef typename V::F F;
+    F m = loadLanes<V>(params.mass, indices, first, lane);
+    F dx = V::set1(params.dx);
+    V::store(&out.mass[lane], m);
+
+    // APIC: m * C * (i - fx) * dx = affine * i - affine * fx
+    F fx[3], affine[9];
+    for (int b = 0; b < 3; b++)
+        fx[b] = V::load(&stencilFx[b][lane]);
+    for (int k = 0; k < 9; k++) {
+        affine[k] = V::mul(V::mul(m, loadLanes<V>(params.aff[k], indices, first, lane)), dx);
+        V::store(&out.affine[k][lane], affine[k]);
+    }
+    for (int a = 0; a < 3; a++) {
+        F v = loadLanes<V>(params.vel[a], indices, first, lane);
+        F shift = V::add(V::add(V::mul(affine[a * 3 + 0], fx[0]), V::mul(affine[a * 3 + 1], fx[1])),
+                         V::mul(affine[a * 3 + 2], fx[2]));
+        V::store(&out.momentum[a][lane], V::sub(V::mul(m, v), shift));
+    }
+
+    // Neo-Hookean Kirchhoff stress mu (F F^T - I) + lambda log(J) I
+    F def[9];
+    for (int k = 0; k < 9; k++)
+        def[k] = loadLanes<V>(params.def[k], indices, first, lane);
+    F J = V::add(
+        V::sub(V::mul(def[0], V::sub(V::mul(def[4], def[8]), V::mul(def[5], def[7]))),
+               V::mul(def[1], V::sub(V::mul(def[3], def[8]), V::mul(def[5], def[6])))),
+        V::mul(def[2], V::sub(V::mul(def[3], def[7]), V::mul(def[4], def[6]))));
+    J = V::max(J, V::set1(1e-6f)); // Inverted or degenerate element, keep the log finite
+    F logJ = V::log(J);
+
+    F mu = V::set1(params.mu), lambda = V::set1(params.lambda);
+    F scale = V::set1(-params.particleVolume / params.dx);
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            F ffT = V::add(V::add(V::mul(def[r * 3 + 0], def[c * 3 + 0]),
+                                  V::mul(def[r * 3 + 1], def[c * 3 + 1])),
+                           V::mul(def[r * 3 + 2], def[c * 3 + 2]));
+            F stress = r == c ? V::add(V::mul(mu, V::sub(ffT, V::set1(1.0f))), V::mul(lambda, logJ))
+                              : V::mul(mu, ffT);
+            V::store(&out.stress[r * 3 + c][lane], V::mul(stress, scale));
+        }
+    }
+}
+
+// Full vectors first, then the remaining lanes one by one
+template <class V>
+void computeStencils(const float *const pos[3], const int *indices, int first, int count,
+                     StencilBatch &out) {
+    int lane = 0;
+    for (; lane + (int)V::WIDTH <= count; lane += V::WIDTH)
+        stencilLanes<V>(pos, indices, first, lane, out);
+    for (; lane < count; lane++)
+        stencilLanes<VecScalar>(pos, indices, first, lane, out);
+}
+
+template <class V>
+void computeP2GTerms(const P2GTermsParams &params, const int *indices, int first, int count,
+                     const float (*fx)[STENCIL_BATCH], P2GTermsBatch &out) {
+    int lane = 0;
+    for (; lane + (int)V::WIDTH <= count; lane += V::WIDTH)
+        p2gTermsLanes<V>(params, indices, first, lane, fx, out);
+    for (; lane < count; lane++)
+        p2gTermsLanes<VecScalar>(params, indices, first, lane, fx, out);
+}
+
+} // namespace
@@ -0,0 +1,49 @@
+#include "bspline_kernels.h"
+
+// Compiled with AVX2 enabled, see CMakeLists.txt
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#include "bspline_kernels.inl"
+
+namespace {
+
+struct VecAVX2 {
+    typedef __m256 F;
+    enum { WIDTH = 8 };
+    static F load(const float *p) { return _mm256_loadu_ps(p); }
+    static F gather(const float *base, const int *indices) {
+        return _mm256_i32gather_ps(base, _mm256_loadu_si256((const __m256i *)indices), 4);
+    }
+    static void store(float *p, F a) { _mm256_storeu_ps(p, a); }
+    static void storeInt(int *p, F a) {
+        _mm256_storeu_si256((__m256i *)p, _mm256_cvttps_epi32(a));
+    }
+    static F set1(float x) { return _mm256_set1_ps(x); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F max(F a, F b) { return _mm256_max_ps(b, a); }
+    static F floor(F a) { return _mm256_floor_ps(a); }
+    static F log(F a) {
+        float lanes[WIDTH];
+        _mm256_storeu_ps(lanes, a);
+        for (int i = 0; i < WIDTH; i++)
+            lanes[i] = std::log(lanes[i]);
+        return _mm256_loadu_ps(lanes);
+    }
+};
+
+} // namespace
+
+const BSplineKernels *getBSplineKernelsAVX2() {
+    static const BSplineKernels kernels = {computeStencils<VecAVX2>, computeP2GTerms<VecAVX2>};
+    return &kernels;
+}
+
+#else
+
+const BSplineKernels *getBSplineKernelsAVX2() { return 0; }
+
+#endif
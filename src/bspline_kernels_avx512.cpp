@@ -0,0 +1,50 @@
+#include "bspline_kernels.h"
+
+// Compiled with AVX-512F enabled, see CMakeLists.txt
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+#include "bspline_kernels.inl"
+
+namespace {
+
+struct VecAVX512 {
+    typedef __m512 F;
+    enum { WIDTH = 16 };
+    static F load(const float *p) { return _mm512_loadu_ps(p); }
+    static F gather(const float *base, const int *indices) {
+        return _mm512_i32gather_ps(_mm512_loadu_si512(indices), base, 4);
+    }
+    static void store(float *p, F a) { _mm512_storeu_ps(p, a); }
+    static void storeInt(int *p, F a) { _mm512_storeu_si512(p, _mm512_cvttps_epi32(a)); }
+    static F set1(float x) { return _mm512_set1_ps(x); }
+    static F add(F a, F b) { return _mm512_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+    static F max(F a, F b) { return _mm512_max_ps(b, a); }
+    static F floor(F a) {
+        return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    }
+    static F log(F a) {
+        float lanes[WIDTH];
+        _mm512_storeu_ps(lanes, a);
+        for (int i = 0; i < WIDTH; i++)
+            lanes[i] = std::log(lanes[i]);
+        return _mm512_loadu_ps(lanes);
+    }
+};
+
+} // namespace
+
+const BSplineKernels *getBSplineKernelsAVX512() {
+    static const BSplineKernels kernels = {computeStencils<VecAVX512>,
+                                           computeP2GTerms<VecAVX512>};
+    return &kernels;
+}
+
+#else
+
+const BSplineKernels *getBSplineKernelsAVX512() { return 0; }
+
+#endif
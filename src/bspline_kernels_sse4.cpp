@@ -0,0 +1,48 @@
+#include "bspline_kernels.h"
+
+// Compiled with SSE4.1 enabled (see CMakeLists.txt), x64 MSVC builds have no separate flag
+#if defined(__SSE4_1__) || defined(_M_X64)
+
+#include <smmintrin.h>
+
+#include "bspline_kernels.inl"
+
+namespace {
+
+struct VecSSE4 {
+    typedef __m128 F;
+    enum { WIDTH = 4 };
+    static F load(const float *p) { return _mm_loadu_ps(p); }
+    static F gather(const float *base, const int *indices) {
+        return _mm_setr_ps(base[indices[0]], base[indices[1]], base[indices[2]],
+                           base[indices[3]]);
+    }
+    static void store(float *p, F a) { _mm_storeu_ps(p, a); }
+    static void storeInt(int *p, F a) { _mm_storeu_si128((__m128i *)p, _mm_cvttps_epi32(a)); }
+    static F set1(float x) { return _mm_set1_ps(x); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F max(F a, F b) { return _mm_max_ps(b, a); }
+    static F floor(F a) { return _mm_floor_ps(a); }
+    static F log(F a) {
+        float lanes[WIDTH];
+        _mm_storeu_ps(lanes, a);
+        for (int i = 0; i < WIDTH; i++)
+            lanes[i] = std::log(lanes[i]);
+        return _mm_loadu_ps(lanes);
+    }
+};
+
+} // namespace
+
+const BSplineKernels *getBSplineKernelsSSE4() {
+    static const BSplineKernels kernels = {computeStencils<VecSSE4>, computeP2GTerms<VecSSE4>};
+    return &kernels;
+}
+
+#else
+
+const BSplineKernels *getBSplineKernelsSSE4() { return 0; }
+
+#endif
@@ -0,0 +1,59 @@
+#include "channel_format.h"
+
+const char *getChannelFormatName(int format) {
+    switch (format) {
+    case CHANNEL_FP16:
+        return "fp16";
+    case CHANNEL_BF16:
+        return "bf16";
+    default:
+        return "fp32";
+    }
+}
+
+int getChannelFormatBytes(int format) { return format == CHANNEL_FP32 ? 4 : 2; }
+
+void LoadChannel(const void *data, int format, size_t first, size_t count, float *dst) {
+    const uint16_t *src = (const uint16_t *)data + first;
+    switch (format) {
+    case CHANNEL_FP16:
+        for (size_t i = 0; i < count; i++)
+            dst[i] = halfToFloat(src[i]);
+        break;
+    case CHANNEL_BF16:
+        for (size_t i = 0; i < count; i++)
+            dst[i] = bf16ToFloat(src[i]);
+        break;
+    default:
+        memcpy(dst, (const float *)data + first, count * sizeof(float));
+        break;
+    }
+}
+
+void StoreChannel(void *data, int format, size_t first, size_t count, const float *src,
+                  int rounding, uint32_t seed) {
+    uint16_t *dst = (uint16_t *)data + first;
+    switch (format) {
+    case CHANNEL_FP16:
+        if (rounding == ROUND_STOCHASTIC) {
+            for (size_t i = 0; i < count; i++)
+                dst[i] = floatToHalf(src[i], ROUND_STOCHASTIC, roundingBits(seed, first + i));
+        } else {
+            for (size_t i = 0; i < count; i++)
+                dst[i] = floatToHalf(src[i], ROUND_NEAREST, 0);
+        }
+        break;
+    case CHANNEL_BF16:
+        if (rounding == ROUND_STOCHASTIC) {
+            for (size_t i = 0; i < count; i++)
+                dst[i] = floatToBF16(src[i], ROUND_STOCHASTIC, roundingBits(seed, first + i));
+        } else {
+            for (size_t i = 0; i < count; i++)
+                dst[i] = floatToBF16(src[i], ROUND_NEAREST, 0);
+        }
+        break;
+    default:
+        memcpy((float *)data + first, src, count * sizeof(float));
+        break;
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef CHANNEL_FORMAT_H
+#define CHANNEL_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Storage formats of grid channels. Values are always computed in float; reduced formats only
+// change what is stored between passes.
+#define CHANNEL_FP32 0
+#define CHANNEL_FP16 1 // IEEE half: 11-bit significand, saturates at +-65504
+#define CHANNEL_BF16 2 // bfloat16: float exponent range, 8-bit significand
+#define CHANNEL_FORMATS 3
+
+// Rounding of float values written to reduced channels
+#define ROUND_NEAREST 0    // Round to nearest even
+#define ROUND_STOCHASTIC 1 // Round up with probability equal to the fraction of the step, so
+                           // the stored value is unbiased and errors do not accumulate
+
+const char *getChannelFormatName(int format);
+int getChannelFormatBytes(int format);
+
+static inline uint32_t floatBits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline float bitsFloat(uint32_t u) {
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// Random bits for stochastic rounding of element `index` of a write pass, a counter-based hash
+// so results do not depend on which thread writes the element
+static inline uint32_t roundingBits(uint32_t seed, uint64_t index) {
+    uint64_t x = index * 0x9e3779b97f4a7c15ull + seed;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ull;
+    x ^= x >> 32;
+    return (uint32_t)x;
+}
+
+static inline float halfToFloat(uint16_t h) {
+    // Shift the exponent and significand into place, then rebias. Subnormals are normalized by
+    // a float subtraction, infinities and NaNs get the full exponent.
+    const uint32_t shiftedExp = 0x7c00u << 13;
+    uint32_t u = (uint32_t)(h & 0x7fff) << 13;
+    uint32_t exp = u & shiftedExp;
+    u += (127 - 15) << 23;
+    if (exp == shiftedExp) {
+        u += (128 - 16) << 23;
+    } else if (exp == 0) {
+        u += 1 << 23;
+        u = floatBits(bitsFloat(u) - bitsFloat(113u << 23));
+    }
+    return bitsFloat(u | (uint32_t)(h & 0x8000) << 16);
+}
+
+// `random` supplies the stochastic rounding bits, ignored when rounding to nearest
+static inline uint16_t floatToHalf(float f, int rounding, uint32_t random) {
+    uint32_t u = floatBits(f);
+    uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+    u &= 0x7fffffff;
+    if (u > 0x7f800000)
+        return sign | 0x7e00; // NaN
+    if (u >= 0x38800000) {
+        // Normal half range: drop 13 significand bits, a carry may raise the exponent
+        if (rounding == ROUND_STOCHASTIC)
+            u += random & 0x1fff;
+        else
+            u += 0xfff + ((u >> 13) & 1);
+        if (u >= 0x477ff000 + 0x1000)
+            return sign | 0x7bff; // Saturate at the largest finite half
+        return sign | (uint16_t)((u - (112u << 23)) >> 13);
+    }
+    // Subnormal half range, steps of 2^-24. Rounding up from the largest subnormal gives the
+    // smallest normal, which has the next encoding.
+    float scaled = bitsFloat(u) * 16777216.0f; // Exact
+    uint32_t m = (uint32_t)scaled;
+    float frac = scaled - (float)m;
+    if (rounding == ROUND_STOCHASTIC)
+        m += (float)(random >> 8) * (1.0f / 16777216.0f) < frac ? 1 : 0;
+    else
+        m += (frac > 0.5f || (frac == 0.5f && (m & 1))) ? 1 : 0;
+    return sign | (uint16_t)m;
+}
+
+static inline float bf16ToFloat(uint16_t b) { return bitsFloat((uint32_t)b << 16); }
+
+static inline uint16_t floatToBF16(float f, int rounding, uint32_t random) {
+    uint32_t u = floatBits(f);
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return (uint16_t)((u >> 16) | 0x40); // Quiet NaN
+    if (rounding == ROUND_STOCHASTIC)
+        u += random & 0xffff;
+    else
+        u += 0x7fff + ((u >> 16) & 1);
+    return (uint16_t)(u >> 16);
+}
+
+// Element n of a channel array in any format
+template <int Format> static inline float loadChannel(const void *data, size_t n) {
+    if (Format == CHANNEL_FP16)
+        return halfToFloat(((const uint16_t *)data)[n]);
+    if (Format == CHANNEL_BF16)
+        return bf16ToFloat(((const uint16_t *)data)[n]);
+    return ((const float *)data)[n];
+}
+
+// count floats to / from elements first .. first + count - 1 of a channel array. `seed`
+// selects the stochastic rounding bits of a write pass.
+void LoadChannel(const void *data, int format, size_t first, size_t count, float *dst);
+void StoreChannel(void *data, int format, size_t first, size_t count, const float *src,
+                  int rounding, uint32_t seed);
+
+#endif
@@ -0,0 +1,102 @@
+#include "frame_writer.h"
+
+#include <cstdio>
+
+FrameWriter::FrameWriter(int encodeThreads, int maxPending) : m_encodePool(encodeThreads) {
+    m_maxPending = maxPending > 0 ? maxPending : 1;
+    m_level = PNG_LEVEL_FAST;
+    m_pending = 0;
+    m_written = 0;
+    m_stop = false;
+    m_worker = std::thread(&FrameWriter::workerLoop, this);
+}
+
+FrameWriter::~FrameWriter() {
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    m_worker.join();
+}
+
+void FrameWriter::Submit(const std::string &fname, std::vector<float> &rgb, int w, int h) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_pending >= m_maxPending)
+        m_space.wait(lock);
+
+    m_queue.push_back(Frame());
+    Frame &frame = m_queue.back();
+    frame.fname = fname;
+    frame.w = w;
+    frame.h = h;
+    frame.rgb.swap(rgb);
+    if (!m_freeBuffers.empty()) {
+        rgb.swap(m_freeBuffers.back());
+        m_freeBuffers.pop_back();
+    }
+    m_pending++;
+    lock.unlock();
+    m_wake.notify_one();
+}
+
+void FrameWriter::Flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_pending > 0)
+        m_space.wait(lock);
+}
+
+void FrameWriter::SetLevel(int level) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_level = level;
+}
+
+int FrameWriter::getNumWritten() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+}
+
+void FrameWriter::toneMap(const float *rgb, unsigned char *pix, size_t numPixels) {
+    const float vmax = 1.2f;
+    for (size_t i = 0; i < numPixels * 3; i++) {
+        float v = rgb[i] * 255.0f / vmax;
+        pix[i] = (unsigned char)((v > 255) ? 255 : v);
+    }
+}
+
+void FrameWriter::workerLoop() {
+    std::vector<unsigned char> pix;
+    for (;;) {
+        Frame frame;
+        int level;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stop && m_queue.empty())
+                m_wake.wait(lock);
+            if (m_queue.empty())
+                return; // Stopping, Flush has emptied the queue
+            frame.fname.swap(m_queue.front().fname);
+            frame.rgb.swap(m_queue.front().rgb);
+            frame.w = m_queue.front().w;
+            frame.h = m_queue.front().h;
+            m_queue.pop_front();
+            level = m_level;
+        }
+
+        size_t numPixels = (size_t)frame.w * frame.h;
+        pix.resize(numPixels * 3);
+        toneMap(frame.rgb.data(), pix.data(), numPixels);
+        if (!SavePNG(frame.fname.c_str(), pix.data(), frame.w, frame.h, 3, level, &m_encodePool))
+            printf("ERROR: Cannot write %s\n", frame.fname.c_str());
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_freeBuffers.push_back(std::vector<float>());
+            m_freeBuffers.back().swap(frame.rgb);
+            m_pending--;
+            m_written++;
+        }
+        m_space.notify_all();
+    }
+}
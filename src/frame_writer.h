@@ -0,0 +1,61 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include "png_writer.h"
+#include "thread_pool.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Background output stage for rendered frames: tone mapping to 8-bit RGB, PNG encoding and
+// writing run on a writer thread while the next frame simulates. The PNG row bands are deflated
+// in parallel on encodeThreads threads (the writer thread included). At most maxPending frames are
+// queued or being written; Submit blocks beyond that, so a slow disk or encoder throttles the
+// simulation instead of growing memory. Pixel buffers are recycled between frames.
+class FrameWriter {
+  public:
+    explicit FrameWriter(int encodeThreads = 0, int maxPending = 2); // 0 = all hardware threads
+    ~FrameWriter(); // Flushes pending frames
+
+    // Queue a float RGB frame (3 floats per pixel, same mapping as OptixScene::SaveOutput).
+    // The pixels are swapped with a recycled buffer, which `rgb` holds on return.
+    void Submit(const std::string &fname, std::vector<float> &rgb, int w, int h);
+
+    // Wait until every submitted frame has been written
+    void Flush();
+
+    // PNG_LEVEL_FAST or PNG_LEVEL_DEFAULT, used from the next frame encoded
+    void SetLevel(int level);
+
+    int getNumWritten();
+
+  private:
+    struct Frame {
+        std::string fname;
+        std::vector<float> rgb;
+        int w, h;
+    };
+
+    void workerLoop();
+    static void toneMap(const float *rgb, unsigned char *pix, size_t numPixels);
+
+    std::thread m_worker;
+    ThreadPool m_encodePool; // Used by the writer thread only
+    int m_maxPending;
+    int m_level;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;  // Writer: a frame was queued or stop
+    std::condition_variable m_space; // Submit / Flush: a frame was written
+    std::deque<Frame> m_queue;
+    std::vector<std::vector<float> > m_freeBuffers;
+    int m_pending; // Queued or being written
+    int m_written;
+    bool m_stop;
+};
+
+#endif
@@ -5,6 +5,11 @@
 #define SCATTER_REDUCE 0
 #define SCATTER 1
 #define GATHER 2
+#define SCATTER_COLORED 3 // CPU backend only
+
+// Simulation backends
+#define BACKEND_GPU 0
+#define BACKEND_CPU 1
 
 // GVDB library
 #include "gvdb.h"
@@ -20,12 +25,33 @@ using namespace nvdb;
 
 #include "string_helper.h"
 
+// CPU MPM engine
+#include "mpm_cpu.h"
+#include "particle_io.h"
+#include "particle_set.h"
+#include "particle_sort.h"
+#include "png_writer.h"
+#include "profiler.h"
+#include "render_cpu.h"
+
 VolumeGVDB gvdb;
+MPMSolverCPU cpuMPM;
+LevelSetRendererCPU cpuRender;
+ParticleSorter particleSorter;
+Profiler profiler;
+
+// Profiled phase scope: NVTX range plus a pooled timer resolved once per frame
+#define PROFILE_PUSH(name) { PERF_PUSH(name); profiler.Push(name); }
+#define PROFILE_POP() { profiler.Pop(); PERF_POP(); }
 
 #ifdef USE_OPTIX
 // OptiX scene
 #include "optix_scene.h"
 OptixScene optx;
+
+// PNG frames are written in the background while the next frame simulates
+#include "frame_writer.h"
+FrameWriter frameWriter;
 #endif
 
 struct PolyModel {
@@ -47,6 +73,7 @@ class Sample : public NVPWindow {
     virtual void mouse(NVPWindow::MouseButton button, NVPWindow::ButtonAction state, int mods,
                        int x, int y);
     virtual void on_arg(std::string arg, std::string val);
+    int run_headless(int argc, const char **argv);
 
     void parse_scene(std::string fname);
     void parse_value(int mode, std::string tag, std::string val);
@@ -55,15 +82,26 @@ class Sample : public NVPWindow {
     void load_points(std::string pntpath, std::string pntfile, int frame);
     void load_polys(std::string polypath, std::string polyfile, int frame, float pscale,
                     Vector3DF poffs, int pmat);
+    void alloc_points(DataPtr &p, int components, const float *data, const float *fill);
+    void sort_particles();
     void clear_gvdb();
     void render_update();
+    void p2g_cpu();
+    void render_update_cpu();
+    void render_update_gpu();
+    void update_delta_time(Vector3DF velMin, Vector3DF velMax, float cellSize,
+                           float frameTimeElapsed, float frameTimeTarget);
     void render_frame();
+    void render_cpu();
+    void queue_png(int w, int h);
     void draw_points();
     void draw_topology(); // draw gvdb topology
     void start_guis(int w, int h);
     void ClearOptix();
     void RebuildOptixGraph(int shading);
     void ReportMemory();
+    float measure_memory();
+    void report_run();
 
     int m_radius;
     Vector3DF m_origin;
@@ -75,6 +113,8 @@ class Sample : public NVPWindow {
     DataPtr m_particleDeformationGradients;
     DataPtr m_particleAffineStates;
     float m_particleInitialVolume;
+    float m_particleDensity; // Initial particle mass / volume (kg/m^3)
+    ParticleSet m_particles;
 
     float simulationFPS;
     float deltaTime;
@@ -92,9 +132,14 @@ class Sample : public NVPWindow {
     int gl_screen_tex;
     int mouse_down;
     bool m_render_optix;
+    int m_cpu_render; // CPU backend ray marcher: 1 on, 0 off, -1 only with a window
+    bool m_incremental_topology; // CPU backend: update only the bricks particles moved in or out
+    int m_channel_format;        // CPU backend: momentum and force storage, CHANNEL_*
+    int m_rounding;              // CPU backend: rounding to reduced channels, ROUND_*
     bool m_show_points;
     bool m_show_topo;
     bool m_save_png;
+    std::vector<float> m_frame_pixels; // Output copy handed to the frame writer
 
     int m_smooth;
     Vector3DF m_smoothp;
@@ -114,6 +159,8 @@ class Sample : public NVPWindow {
 
     std::string m_infile;
     std::string m_envfile;
+    Vector3DF m_backclr; // Scene background, also used by the CPU ray marcher
+    float m_render_step; // Scene ray march step
     std::string m_outpath;
     std::string m_outfile;
 
@@ -122,12 +169,28 @@ class Sample : public NVPWindow {
 
     int m_iteration;
     int m_p2g_algorithm;
+    int m_subcell_size; // Gather P2G particle index subcell edge in voxels
     bool m_p2g_only;
     int m_iteration_limit;
     int m_frame_limit;
+    int m_backend;
+    int m_cpu_threads;
+    int m_simd_level; // CPU backend B-spline kernels, -1 = best supported
+    int m_kernel_order; // CPU backend B-spline order (KERNEL_*)
+    int m_dimension;    // CPU backend simulation dimension, 2 or 3
+    int m_png_level;    // PNG_LEVEL_* of the saved frames
+    bool m_headless;
+    std::string m_trace_file;
+    int m_sort_interval;    // Iterations between particle sorts (checks with a threshold), 0 = off
+    float m_sort_threshold; // Sort only above this disorder, 0 = always
+    int m_last_sort_iteration;
+    int m_first_sort_iteration;
+    int m_num_sorts;
 
     bool m_info;
     int m_io_method;
+    float m_peak_memory; // MB
+    bool m_run_reported; // report_run done, windowed runs keep redisplaying after the limits
 };
 
 Sample sample_obj;
@@ -288,9 +351,28 @@ Sample::Sample() {
 
     m_iteration = 0;
     m_p2g_algorithm = SCATTER_REDUCE;
+    m_subcell_size = 4;
     m_p2g_only = false; // Do full MPM instead of only benchmark P2G levelset
     m_iteration_limit = 0; // Unlimited
     m_frame_limit = 0; // Unlimited
+    m_backend = BACKEND_GPU;
+    m_cpu_threads = 0; // All hardware threads
+    m_simd_level = -1;
+    m_kernel_order = KERNEL_QUADRATIC;
+    m_dimension = 3;
+    m_png_level = PNG_LEVEL_FAST;
+    m_cpu_render = -1;
+    m_incremental_topology = false;
+    m_channel_format = CHANNEL_FP32;
+    m_rounding = ROUND_NEAREST;
+    m_headless = false;
+    m_peak_memory = 0.0;
+    m_run_reported = false;
+    m_sort_interval = 0;
+    m_sort_threshold = 0.0;
+    m_last_sort_iteration = 0;
+    m_first_sort_iteration = -1;
+    m_num_sorts = 0;
 }
 
 void Sample::parse_value(int mode, std::string tag, std::string val) {
@@ -370,6 +452,7 @@ void Sample::parse_value(int mode, std::string tag, std::string val) {
             if (strEq(tag, "backclr")) {
                 strToVec3(val, "<", ",", ">", &vec.x);
                 gvdb.getScene()->SetBackgroundClr(vec.x, vec.y, vec.z, 1.0);
+                m_backclr = vec;
             }
             if (strEq(tag, "envmap"))
                 m_envfile = val;
@@ -386,6 +469,7 @@ void Sample::parse_value(int mode, std::string tag, std::string val) {
             if (strEq(tag, "steps")) {
                 strToVec3(val, "<", ",", ">", &vec.x);
                 scn->SetSteps(vec.x, vec.y, vec.z);
+                m_render_step = vec.x;
             }
             if (strEq(tag, "extinct")) {
                 strToVec3(val, "<", ",", ">", &vec.x);
@@ -527,11 +611,95 @@ void Sample::on_arg(std::string arg, std::string val) {
         } else if (val.compare("gather") == 0) {
             m_p2g_algorithm = GATHER;
             nvprintf("P2G algorithm: gather\n");
+        } else if (val.compare("scatter_colored") == 0) {
+            m_p2g_algorithm = SCATTER_COLORED;
+            nvprintf("P2G algorithm: scatter_colored\n");
         } else {
             m_p2g_algorithm = SCATTER_REDUCE;
             nvprintf("P2G algorithm: scatter_reduce\n");
         }
     }
+    else if (arg.compare("-backend") == 0) {
+        if (val.compare("cpu") == 0) {
+            m_backend = BACKEND_CPU;
+            nvprintf("Backend: cpu\n");
+        } else {
+            m_backend = BACKEND_GPU;
+            nvprintf("Backend: gpu\n");
+        }
+    }
+    else if (arg.compare("-subcell-size") == 0) {
+        m_subcell_size = strToNum(val);
+        nvprintf("Gather subcell size: %d\n", m_subcell_size);
+    }
+    else if (arg.compare("-simd") == 0) {
+        m_simd_level = -1;
+        for (int level = SIMD_SCALAR; level < SIMD_LEVELS; level++) {
+            if (val.compare(getSimdName(level)) == 0)
+                m_simd_level = level;
+        }
+        nvprintf("SIMD kernels: %s\n", m_simd_level < 0 ? "best supported" : val.c_str());
+    }
+    else if (arg.compare("-kernel") == 0) {
+        if (val.compare("linear") == 0) {
+            m_kernel_order = KERNEL_LINEAR;
+        } else if (val.compare("cubic") == 0) {
+            m_kernel_order = KERNEL_CUBIC;
+        } else {
+            m_kernel_order = KERNEL_QUADRATIC;
+            val = "quadratic";
+        }
+        nvprintf("Transfer kernel: %s\n", val.c_str());
+    }
+    else if (arg.compare("-dim") == 0) {
+        m_dimension = strToNum(val) == 2 ? 2 : 3;
+        nvprintf("Dimension: %d\n", m_dimension);
+    }
+    else if (arg.compare("-cpu-render") == 0) {
+        m_cpu_render = (val.compare("0") != 0) ? 1 : 0;
+        nvprintf("CPU render: %s\n", m_cpu_render ? "on" : "off");
+    }
+    else if (arg.compare("-topology") == 0) {
+        m_incremental_topology = (val.compare("incremental") == 0);
+        nvprintf("Topology rebuild: %s\n", m_incremental_topology ? "incremental" : "full");
+    }
+    else if (arg.compare("-channel-format") == 0) {
+        m_channel_format = CHANNEL_FP32;
+        for (int format = CHANNEL_FP32; format < CHANNEL_FORMATS; format++) {
+            if (val.compare(getChannelFormatName(format)) == 0)
+                m_channel_format = format;
+        }
+        nvprintf("Momentum and force channels: %s\n", getChannelFormatName(m_channel_format));
+    }
+    else if (arg.compare("-rounding") == 0) {
+        m_rounding = (val.compare("stochastic") == 0) ? ROUND_STOCHASTIC : ROUND_NEAREST;
+        nvprintf("Channel rounding: %s\n",
+                 m_rounding == ROUND_STOCHASTIC ? "stochastic" : "nearest");
+    }
+    else if (arg.compare("-png-level") == 0) {
+        m_png_level = (val.compare("default") == 0) ? PNG_LEVEL_DEFAULT : PNG_LEVEL_FAST;
+        nvprintf("PNG level: %s\n", m_png_level == PNG_LEVEL_DEFAULT ? "default" : "fast");
+    }
+    else if (arg.compare("-threads") == 0) {
+        m_cpu_threads = strToNum(val);
+        nvprintf("CPU threads: %d\n", m_cpu_threads);
+    }
+    else if (arg.compare("-headless") == 0) {
+        m_headless = (val.compare("0") != 0);
+        nvprintf("Headless: %s\n", m_headless ? "yes" : "no");
+    }
+    else if (arg.compare("-trace") == 0) {
+        m_trace_file = val;
+        nvprintf("Trace file: %s\n", m_trace_file.c_str());
+    }
+    else if (arg.compare("-sort-interval") == 0) {
+        m_sort_interval = strToNum(val);
+        nvprintf("Particle sort interval: %d\n", m_sort_interval);
+    }
+    else if (arg.compare("-sort-threshold") == 0) {
+        m_sort_threshold = strToNum(val);
+        nvprintf("Particle sort disorder threshold: %f\n", m_sort_threshold);
+    }
     else if (arg.compare("-iteration-limit") == 0) {
         m_iteration_limit = strToNum(val);
         nvprintf("Iteration limit: %d\n", m_iteration_limit);
@@ -573,7 +741,13 @@ bool Sample::init() {
 
     m_sample = 0;
     m_save_png = true;
-    m_render_optix = true;
+    // CPU backend runs without CUDA or OptiX and renders with its own ray marcher, by default
+    // only with a window. Headless GPU runs do not render.
+    m_render_optix = (m_backend == BACKEND_GPU) && !m_headless;
+    if (m_cpu_render < 0)
+        m_cpu_render = m_headless ? 0 : 1;
+    if (m_backend != BACKEND_CPU)
+        m_cpu_render = 0;
     m_smooth = 0;
     m_smoothp.Set(0, 0, 0);
 
@@ -591,7 +765,8 @@ bool Sample::init() {
     simulationFPS = 60.0; // Simulation output FPS configuration
     elapsedTime = 0.0;
     deltaTime = 1e-4;
-    init2D("arial");
+    if (!m_headless)
+        init2D("arial");
 
     // Initialize Optix Scene
     if (m_render_optix) {
@@ -601,11 +776,76 @@ bool Sample::init() {
     gvdb.SetDebug(true); // DEBUG
     gvdb.SetVerbose(true); // DEBUG
     gvdb.SetProfile(false, true);
-    gvdb.SetCudaDevice(m_render_optix ? GVDB_DEV_CURRENT : GVDB_DEV_FIRST);
-    gvdb.Initialize();
-    gvdb.StartRasterGL();
+    if (m_backend == BACKEND_GPU)
+        gvdb.SetCudaDevice(m_render_optix ? GVDB_DEV_CURRENT : GVDB_DEV_FIRST);
+    gvdb.Initialize(); // Also needed on CPU backend for scene and asset management
+    if (m_backend == BACKEND_GPU && !m_headless)
+        gvdb.StartRasterGL();
     gvdb.AddPath(ASSET_PATH);
 
+    profiler.SetBackend(m_backend == BACKEND_CPU ? PROFILE_CPU : PROFILE_CUDA);
+    if (!m_trace_file.empty())
+        profiler.OpenTrace(m_trace_file);
+
+    if (m_backend == BACKEND_CPU) {
+        cpuMPM.SetThreads(m_cpu_threads);
+        nvprintf("CPU backend: %d threads\n", cpuMPM.getNumThreads());
+        cpuMPM.SetSubcellSize(m_subcell_size);
+        cpuMPM.SetKernel(m_kernel_order, m_dimension);
+        cpuMPM.SetIncrementalTopology(m_incremental_topology);
+        cpuMPM.SetChannelFormat(CHAN_MOMENTUM, m_channel_format);
+        cpuMPM.SetChannelFormat(CHAN_FORCE, m_channel_format);
+        cpuMPM.SetRounding(m_rounding);
+        if (m_channel_format != CHANNEL_FP32 &&
+            (m_p2g_algorithm == SCATTER || m_p2g_algorithm == SCATTER_COLORED)) {
+            nvprintf("CPU backend: %s channels, using scatter_reduce P2G\n",
+                     getChannelFormatName(m_channel_format));
+            m_p2g_algorithm = SCATTER_REDUCE;
+        }
+        cpuRender.SetPool(cpuMPM.getPool());
+
+        // Check the vector kernels against the scalar ones before trusting them. They are built
+        // without FMA contraction and must match bit for bit, or -simd levels would give
+        // different results.
+        if (m_simd_level >= 0)
+            cpuMPM.SetSimdLevel(m_simd_level);
+        float difference = CompareBSplineKernels(cpuMPM.getSimdLevel());
+        if (difference != 0.0f) {
+            nvprintf("CPU backend: %s kernels differ from scalar (%g), using scalar\n",
+                     getSimdName(cpuMPM.getSimdLevel()), difference);
+            cpuMPM.SetSimdLevel(SIMD_SCALAR);
+        }
+        nvprintf("CPU backend: %s kernels\n", getSimdName(cpuMPM.getSimdLevel()));
+    } else {
+        if (m_p2g_algorithm == SCATTER_COLORED) {
+            nvprintf("GPU backend: P2G algorithm not available, using scatter\n");
+            m_p2g_algorithm = SCATTER;
+        }
+        if (m_kernel_order != KERNEL_QUADRATIC || m_dimension != 3) {
+            nvprintf("GPU backend: only quadratic 3D transfers, ignoring -kernel and -dim\n");
+            m_kernel_order = KERNEL_QUADRATIC;
+            m_dimension = 3;
+        }
+        if (m_incremental_topology) {
+            nvprintf("GPU backend: incremental topology not available, using full rebuilds\n");
+            m_incremental_topology = false;
+        }
+        if (m_channel_format != CHANNEL_FP32) {
+            nvprintf("GPU backend: reduced-precision channels not available, using fp32\n");
+            m_channel_format = CHANNEL_FP32;
+        }
+    }
+
+    // Particle sorting runs on the host for both backends
+    if (m_sort_threshold > 0.0 && m_sort_interval == 0)
+        m_sort_interval = 1;
+    if (m_sort_interval > 0) {
+        if (m_backend == BACKEND_CPU)
+            particleSorter.SetPool(cpuMPM.getPool());
+        else
+            particleSorter.SetThreads(m_cpu_threads);
+    }
+
     // Default Camera
     Camera3D *cam = new Camera3D;
     cam->setFov(50.0);
@@ -620,10 +860,12 @@ bool Sample::init() {
 
     // Default volume params
     gvdb.getScene()->SetSteps(0.1f, 16, 0.1f);          // Set raycasting steps
+    m_render_step = 0.1f;
     gvdb.getScene()->SetExtinct(-1.0f, 1.1f, 0.0f);     // Set volume extinction
     gvdb.getScene()->SetVolumeRange(0.0f, -1.0f, 3.0f); // Set volume value range
     gvdb.getScene()->SetCutoff(0.005f, 0.001f, 0.0f);
     gvdb.getScene()->SetBackgroundClr(0.1f, 0.2f, 0.4f, 1.0);
+    m_backclr.Set(0.1f, 0.2f, 0.4f);
 
     // Parse scene file
     if (m_render_optix)
@@ -632,38 +874,44 @@ bool Sample::init() {
 
     // Add render buffer
     nvprintf("Output buffer: %d x %d\n", m_w, m_h);
-    gvdb.AddRenderBuf(0, m_w, m_h, 4);
+    if (m_backend == BACKEND_GPU && !m_headless)
+        gvdb.AddRenderBuf(0, m_w, m_h, 4);
 
-    // Resize window
-    resize_window(m_w, m_h);
+    if (!m_headless) {
+        // Resize window
+        resize_window(m_w, m_h);
 
-    // Create opengl texture for display
-    glViewport(0, 0, m_w, m_h);
-    createScreenQuadGL(&gl_screen_tex, m_w, m_h);
+        // Create opengl texture for display
+        glViewport(0, 0, m_w, m_h);
+        createScreenQuadGL(&gl_screen_tex, m_w, m_h);
+    }
 
-    // Configure
-    gvdb.Configure(3, 3, 3, 3, 3); // Brick size fixed at 8x8x8 (last parameter)
-    gvdb.SetChannelDefault(32, 32, 1); // Default atlas dimension to allocate in number of bricks
+    // Configure (GVDB grid is only used by the GPU backend)
+    if (m_backend == BACKEND_GPU) {
+        gvdb.Configure(3, 3, 3, 3, 3); // Brick size fixed at 8x8x8 (last parameter)
+        gvdb.SetChannelDefault(32, 32, 1); // Default atlas dimension to allocate in number of bricks
 
-    // Level set channel for rendering (texture channel with apron size 1)
-    // Positive value is outside material, negative value is inside. Background initialized to 3.0
-    gvdb.AddChannel(0, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), true, Vector4DF(3.0, 0.0, 0.0, 0.0));
+        // Level set channel for rendering (texture channel with apron size 1)
+        // Positive value is outside material, negative value is inside. Background initialized to 3.0
+        gvdb.AddChannel(0, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), true, Vector4DF(3.0, 0.0, 0.0, 0.0));
 
-    // Momentum/velocity channels
-    gvdb.AddChannel(1, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
-    gvdb.AddChannel(2, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
-    gvdb.AddChannel(3, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        // Momentum/velocity channels
+        gvdb.AddChannel(1, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        gvdb.AddChannel(2, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        gvdb.AddChannel(3, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
 
-    // Force channels
-    gvdb.AddChannel(4, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
-    gvdb.AddChannel(5, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
-    gvdb.AddChannel(6, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        // Force channels
+        gvdb.AddChannel(4, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        gvdb.AddChannel(5, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        gvdb.AddChannel(6, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
 
-    // Mass density channel
-    gvdb.AddChannel(7, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+        // Mass density channel
+        gvdb.AddChannel(7, T_FLOAT, 1, F_LINEAR, F_CLAMP, Vector3DI(0, 0, 0), false, Vector4DF(0.0, 0.0, 0.0, 0.0));
+    }
 
     // Initialize GUIs
-    start_guis(m_w, m_h);
+    if (!m_headless)
+        start_guis(m_w, m_h);
 
     clear_gvdb();
 
@@ -688,7 +936,8 @@ void Sample::reshape(int w, int h) {
     createScreenQuadGL(&gl_screen_tex, w, h);
 
     // Resize the GVDB render buffers
-    gvdb.ResizeRenderBuf(0, w, h, 4);
+    if (m_backend == BACKEND_GPU)
+        gvdb.ResizeRenderBuf(0, w, h, 4);
 
     // Resize OptiX buffers
     if (m_render_optix)
@@ -712,71 +961,68 @@ void Sample::load_points(std::string pntpath, std::string pntfile, int frame) {
 
     std::cout << "Reading particles from " << path << std::endl;
 
-    float particleInitialMass;
-
-    std::ifstream fin;
-    fin.open(path.c_str());
-
-    fin >> m_numpnts; // Number of particles
-    fin >> m_particleInitialVolume; // Initial volume of one particle, (m^3)
-    fin >> particleInitialMass; // Mass of one particle (kg)
-
-    gvdb.AllocData(m_particlePositions, m_numpnts, sizeof(Vector3DF), true);
-    gvdb.AllocData(m_particleMasses, m_numpnts, sizeof(float), true);
-    gvdb.AllocData(m_particleVelocities, m_numpnts, sizeof(float) * 3, true);
-    gvdb.AllocData(m_particleDeformationGradients, m_numpnts, sizeof(float) * 9, true);
-    gvdb.AllocData(m_particleAffineStates, m_numpnts, sizeof(float) * 9, true);
-
-    // Particle positions in grid units (cm)
-    Vector3DF *particlesInput = (Vector3DF*) m_particlePositions.cpu;
-    for (int i = 0; i < m_numpnts; i++) {
-        fin >> particlesInput[i].x >> particlesInput[i].y >> particlesInput[i].z;
-    }
-
-    fin.close();
-
-    // Initialize particle data
-    for (int i = 0; i < m_numpnts; i++) {
-        // Initial particle mass
-        *(((float*) m_particleMasses.cpu) + i) = particleInitialMass;
-
-        // Velocity
-        float *velocity = ((float *)m_particleVelocities.cpu) + i * 3;
-        velocity[0] = 0.0;
-        velocity[1] = 0.0;
-        velocity[2] = 0.0;
-
-        // Deformation gradient (initialize to identity matrix)
-        float *deformationGradient = ((float *)m_particleDeformationGradients.cpu) + i * 9;
-        deformationGradient[0] = 1.0;
-        deformationGradient[1] = 0.0;
-        deformationGradient[2] = 0.0;
-        deformationGradient[3] = 0.0;
-        deformationGradient[4] = 1.0;
-        deformationGradient[5] = 0.0;
-        deformationGradient[6] = 0.0;
-        deformationGradient[7] = 0.0;
-        deformationGradient[8] = 1.0;
-
-        // APIC affine state (initialize to zero matrix)
-        float *affineState = ((float *)m_particleAffineStates.cpu) + i * 9;
-        affineState[0] = 0.0;
-        affineState[1] = 0.0;
-        affineState[2] = 0.0;
-        affineState[3] = 0.0;
-        affineState[4] = 0.0;
-        affineState[5] = 0.0;
-        affineState[6] = 0.0;
-        affineState[7] = 0.0;
-        affineState[8] = 0.0;
+    // Binary particle files are mapped and used without parsing: their blocks already have the
+    // interleaved layout of the GPU DataPtrs
+    int count;
+    float particleInitialVolume, particleInitialMass;
+    ParticleFile pfile;
+    std::vector<float> textPositions;
+    const float *positions;
+    const float *initialState[3] = {0, 0, 0}; // Velocity, deformation gradient, affine state
+    if (isParticleFile(path)) {
+        if (!pfile.Open(path))
+            return;
+        count = pfile.getCount();
+        particleInitialVolume = pfile.getHeader().initialVolume; // One particle, (m^3)
+        particleInitialMass = pfile.getHeader().mass; // One particle (kg)
+        positions = pfile.getPositions();
+        initialState[0] = pfile.getVelocities();
+        initialState[1] = pfile.getDeformationGradients();
+        initialState[2] = pfile.getAffineStates();
+    } else {
+        if (!readParticleText(path, textPositions, particleInitialVolume, particleInitialMass))
+            return;
+        count = (int)(textPositions.size() / 3);
+        positions = &textPositions[0];
+    }
+
+    // Particle data missing from the file: initial mass, zero velocity, identity deformation
+    // gradient and zero APIC affine state
+    const float zero[9] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    const float identity[9] = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+
+    // The CPU backend simulates on the SoA particle set directly. The particle count only
+    // changes once there is room for the particles.
+    if (m_backend == BACKEND_CPU && !m_particles.Resize(count)) {
+        printf("Out of memory for %d particles, not loaded.\n", count);
+        return;
+    }
+    m_numpnts = count;
+    m_particleInitialVolume = particleInitialVolume;
+    m_particleDensity = particleInitialMass / particleInitialVolume;
+
+    if (m_backend == BACKEND_CPU) {
+        m_particles.SetInterleaved(PARTICLE_POSITION, positions);
+        m_particles.Fill(PARTICLE_MASS, &particleInitialMass);
+        const int attributes[3] = {PARTICLE_VELOCITY, PARTICLE_DEFORMATION, PARTICLE_AFFINE};
+        const float *defaults[3] = {zero, identity, zero};
+        for (int i = 0; i < 3; i++) {
+            if (initialState[i])
+                m_particles.SetInterleaved(attributes[i], initialState[i]);
+            else
+                m_particles.Fill(attributes[i], defaults[i]);
+        }
+        cpuMPM.SetPoints(&m_particles);
+        printf("Read %d particles.\n", m_numpnts);
+        return;
     }
 
     // Commit particle data to GPU
-    gvdb.CommitData(m_particlePositions);
-    gvdb.CommitData(m_particleMasses);
-    gvdb.CommitData(m_particleVelocities);
-    gvdb.CommitData(m_particleDeformationGradients);
-    gvdb.CommitData(m_particleAffineStates);
+    alloc_points(m_particlePositions, 3, positions, 0);
+    alloc_points(m_particleMasses, 1, 0, &particleInitialMass);
+    alloc_points(m_particleVelocities, 3, initialState[0], zero);
+    alloc_points(m_particleDeformationGradients, 9, initialState[1], identity);
+    alloc_points(m_particleAffineStates, 9, initialState[2], zero);
 
     // Set points for GVDB
     gvdb.SetPoints(m_particlePositions, m_particleMasses, m_particleVelocities,
@@ -812,66 +1058,299 @@ void Sample::load_polys(std::string polypath, std::string polyfile, int frame, f
 }
 
 void Sample::ReportMemory() {
+    if (m_backend == BACKEND_CPU) {
+        SparseGrid &grid = cpuMPM.getGrid();
+        for (int l = grid.getNumLevels() - 1; l >= 0; l--)
+            nvprintf("  CPU grid level %d: %d active nodes\n", l, grid.getNumNodes(l));
+        nvprintf("  CPU grid: %d bricks of %d^3, %.2f MB\n", grid.getNumBricks(), grid.getBrickRes(),
+                 grid.getMemoryUsage() / (1024.0 * 1024.0));
+        nvprintf("  CPU grid: %d bricks with mass\n", (int)cpuMPM.getActiveBricks().size());
+        const BrickPool &pool = grid.getBrickPool();
+        nvprintf("  CPU grid: brick pool of %d bricks, high-water mark %d, %d allocations\n",
+                 pool.getCapacity(), pool.getHighWater(), pool.getNumGrowths());
+        nvprintf("  CPU grid: momentum %s, force %s\n",
+                 getChannelFormatName(grid.getChannelFormat(CHAN_MOMENTUM)),
+                 getChannelFormatName(grid.getChannelFormat(CHAN_FORCE)));
+        if (grid.getIncremental())
+            nvprintf("  CPU grid: last rebuild activated %d, deactivated %d bricks\n",
+                     grid.getNumActivated(), grid.getNumDeactivated());
+        return;
+    }
     std::vector<std::string> outlist;
     gvdb.MemoryUsage("gvdb", outlist);
     for (int n = 0; n < outlist.size(); n++)
         nvprintf("%s", outlist[n].c_str());
 }
 
+// Current memory use of the simulation in MB: particles, grid and transfer buffers on the CPU
+// backend, used device memory on the GPU backend
+float Sample::measure_memory() {
+    if (m_backend == BACKEND_CPU) {
+        size_t particleBytes = m_particles.getMemoryUsage();
+        size_t gridBytes = cpuMPM.getGrid().getMemoryUsage();
+        size_t transferBytes = cpuMPM.getMemoryUsage(); // Differs between P2G algorithms
+        return (particleBytes + gridBytes + transferBytes) / (1024.0 * 1024.0);
+    }
+    size_t freeBytes = 0, totalBytes = 0;
+    cudaMemGetInfo(&freeBytes, &totalBytes);
+    return (totalBytes - freeBytes) / (1024.0 * 1024.0);
+}
+
+// Summary at the end of a run: phase statistics, peak memory, and completing the trace file.
+// Runs once.
+void Sample::report_run() {
+    if (m_run_reported)
+        return;
+    m_run_reported = true;
+    profiler.Report();
+    printf("Peak memory: %.2f MB\n", m_peak_memory);
+
+    // One P2G sample per MPM iteration, so the samples split at the first sort
+    const std::vector<float> *p2g = profiler.getSamples("P2G");
+    if (m_num_sorts > 0 && p2g && (int)p2g->size() > m_first_sort_iteration) {
+        double before = 0.0, after = 0.0;
+        for (int i = 0; i < (int)p2g->size(); i++)
+            (i < m_first_sort_iteration ? before : after) += (*p2g)[i];
+        before /= m_first_sort_iteration;
+        after /= (int)p2g->size() - m_first_sort_iteration;
+        printf("Particle sort: %d sorts, mean P2G %.3f ms before the first sort, %.3f ms after "
+               "(%.2fx)\n",
+               m_num_sorts, before, after, after > 0.0 ? before / after : 0.0);
+    }
+    profiler.CloseTrace();
+    frameWriter.Flush();
+}
+
+// Reorder the particles along a Morton curve every m_sort_interval iterations. With a threshold,
+// the sampled disorder is checked at the same interval and the sort only runs above it.
+// GPU particle data goes through the host.
+void Sample::sort_particles() {
+    if (!m_sort_interval || m_p2g_only || m_iteration - m_last_sort_iteration < m_sort_interval)
+        return;
+    m_last_sort_iteration = m_iteration;
+
+    PROFILE_PUSH("Particle sort");
+    bool sorted = false;
+    if (m_backend == BACKEND_CPU) {
+        if (m_sort_threshold <= 0.0 ||
+            particleSorter.MeasureDisorder(m_particles) > m_sort_threshold) {
+            particleSorter.Sort(m_particles);
+            sorted = true;
+        }
+    } else {
+        gvdb.RetrieveData(m_particlePositions);
+        float *positions = (float *)m_particlePositions.cpu;
+        if (m_sort_threshold <= 0.0 ||
+            particleSorter.MeasureDisorder(m_numpnts, positions) > m_sort_threshold) {
+            gvdb.RetrieveData(m_particleMasses);
+            gvdb.RetrieveData(m_particleVelocities);
+            gvdb.RetrieveData(m_particleDeformationGradients);
+            gvdb.RetrieveData(m_particleAffineStates);
+            particleSorter.Sort(m_numpnts, positions, (float *)m_particleMasses.cpu,
+                                (float *)m_particleVelocities.cpu,
+                                (float *)m_particleDeformationGradients.cpu,
+                                (float *)m_particleAffineStates.cpu);
+            gvdb.CommitData(m_particlePositions);
+            gvdb.CommitData(m_particleMasses);
+            gvdb.CommitData(m_particleVelocities);
+            gvdb.CommitData(m_particleDeformationGradients);
+            gvdb.CommitData(m_particleAffineStates);
+            sorted = true;
+        }
+    }
+    PROFILE_POP();
+
+    if (sorted) {
+        if (m_first_sort_iteration < 0)
+            m_first_sort_iteration = m_iteration;
+        m_num_sorts++;
+    }
+}
+
+// Allocate a GPU particle buffer of `components` floats per particle and commit to it either
+// interleaved `data` or, without data, the `fill` value of every particle
+void Sample::alloc_points(DataPtr &p, int components, const float *data, const float *fill) {
+    size_t stride = sizeof(float) * components;
+    gvdb.AllocData(p, m_numpnts, (int)stride, true);
+    if (data) {
+        memcpy(p.cpu, data, (size_t)m_numpnts * stride);
+    } else {
+        for (int i = 0; i < m_numpnts; i++)
+            memcpy(p.cpu + i * stride, fill, stride);
+    }
+    gvdb.CommitData(p);
+}
+
 void Sample::clear_gvdb() {
+    if (m_backend == BACKEND_CPU)
+        return;
+
     // Clear
     DataPtr temp;
     gvdb.SetPoints(temp, temp, temp, temp, temp);
     gvdb.CleanAux();
 }
 
-float getEventDuration(cudaEvent_t start, cudaEvent_t end) {
-    cudaEventSynchronize(end);
-    float duration = 0.0; // In milliseconds
-    cudaEventElapsedTime(&duration, start, end);
-    return duration;
+// Pick the next time step from the maximum particle speed (CFL) and the time left in the frame
+void Sample::update_delta_time(Vector3DF velMin, Vector3DF velMax, float cellSize,
+                               float frameTimeElapsed, float frameTimeTarget) {
+    Vector3DF maxParticleSpeeds(
+        velMax.x > -velMin.x ? velMax.x : -velMin.x,
+        velMax.y > -velMin.y ? velMax.y : -velMin.y,
+        velMax.z > -velMin.z ? velMax.z : -velMin.z
+    );
+    float maxParticleSpeed = maxParticleSpeeds.x > maxParticleSpeeds.y
+        ? (maxParticleSpeeds.x > maxParticleSpeeds.z ? maxParticleSpeeds.x : maxParticleSpeeds.z)
+        : (maxParticleSpeeds.y > maxParticleSpeeds.z ? maxParticleSpeeds.y : maxParticleSpeeds.z);
+    maxParticleSpeed *= 100.0; // Convert m/s to cm/s (grid units use cm)
+    if (maxParticleSpeed < 1e-6) maxParticleSpeed = 1e-6;
+    float calculatedDeltaTime = 0.01 * (cellSize / maxParticleSpeed);
+
+    /*
+    // DEBUG
+    printf("Max speeds: %f %f %f\n", maxParticleSpeeds.x, maxParticleSpeeds.y, maxParticleSpeeds.z);
+    printf("Calculated delta time: %f\n", calculatedDeltaTime);
+    */
+
+    // Update delta time based on calculation delta time and remaining time to next frame
+    if (calculatedDeltaTime > 1e-4) calculatedDeltaTime = 1e-4; // Limit delta time maximum
+    if (frameTimeElapsed + calculatedDeltaTime > frameTimeTarget) {
+        deltaTime = frameTimeTarget - frameTimeElapsed;
+    } else if (frameTimeElapsed + 1.8*calculatedDeltaTime > frameTimeTarget) {
+        deltaTime = (frameTimeTarget - frameTimeElapsed) / 2.0;
+    } else {
+        deltaTime = calculatedDeltaTime;
+    }
 }
 
-void Sample::render_update() {
-    if (m_frame_limit && (m_frame >= m_frame_limit)) {
-        printf("\nReached frame limit, stopping...\n");
-        m_active = false;
+void Sample::p2g_cpu() {
+    if (m_p2g_algorithm == SCATTER_COLORED)
+        cpuMPM.P2G_ColoredScatterAPIC(m_numpnts, m_particleInitialVolume);
+    else if (m_p2g_algorithm == SCATTER_REDUCE)
+        cpuMPM.P2G_ScatterReduceAPIC(m_numpnts, m_particleInitialVolume);
+    else if (m_p2g_algorithm == GATHER)
+        cpuMPM.P2G_GatherAPIC(m_numpnts, m_particleInitialVolume);
+    else
+        cpuMPM.P2G_ScatterAPIC(m_numpnts, m_particleInitialVolume);
+}
+
+void Sample::render_update_cpu() {
+    if (m_p2g_only) {
+        printf("  P2G... ");
+
+        PROFILE_PUSH("Dynamic Topology");
+        bool built = cpuMPM.RebuildTopology(m_numpnts);
+        PROFILE_POP();
+        if (!built) {
+            printf("\nOut of memory for the CPU grid bricks, stopping...\n");
+            m_active = false;
+            return;
+        }
+
+        PROFILE_PUSH("P2G");
+        p2g_cpu();
+        PROFILE_POP();
+
+        m_iteration++;
+        printf("OK\n");
         return;
     }
 
-    if (!m_pnton)
-        return;
+    printf("  MPM (CPU)... ");
 
-    cuProfilerStart();
+    float frameTimeElapsed = 0.0;
+    float frameTimeTarget = 1.0 / simulationFPS;
+    int frameIteration = 0;
 
-    printf("\n[Frame %d] \n", m_frame);
+    PROFILE_PUSH("Frame");
+    while (frameTimeElapsed < frameTimeTarget && m_active) {
+        if (m_iteration_limit && (m_iteration >= m_iteration_limit)) {
+            printf("\nReached iteration limit, stopping...\n");
+            m_active = false;
+            break;
+        }
+        profiler.SetContext(m_frame, m_iteration, m_numpnts);
+        sort_particles();
+
+        // Fit grid around particles and clear channels
+        PROFILE_PUSH("Dynamic Topology");
+        bool built = cpuMPM.RebuildTopology(m_numpnts);
+        PROFILE_POP();
+        if (!built) {
+            printf("\nOut of memory for the CPU grid bricks, stopping...\n");
+            m_active = false;
+            break;
+        }
+
+        PROFILE_PUSH("MPM");
+
+        // P2G
+        PROFILE_PUSH("P2G");
+        p2g_cpu();
+        PROFILE_POP();
+
+        // Add external forces, handle collisions, update grid velocity
+        PROFILE_PUSH("Grid update");
+        cpuMPM.MPM_GridUpdate(deltaTime);
+        PROFILE_POP();
+
+        // G2P and particle advection
+        PROFILE_PUSH("G2P");
+        cpuMPM.G2P_GatherAPIC(m_numpnts, deltaTime);
+        PROFILE_POP();
+
+        // Calculate delta time based on maximum particle speeds, reduced during G2P
+        update_delta_time(Vector3DF(cpuMPM.mVelMin[0], cpuMPM.mVelMin[1], cpuMPM.mVelMin[2]),
+                          Vector3DF(cpuMPM.mVelMax[0], cpuMPM.mVelMax[1], cpuMPM.mVelMax[2]),
+                          1.0, frameTimeElapsed, frameTimeTarget);
+
+        PROFILE_POP();
+
+        elapsedTime += deltaTime;
+        frameTimeElapsed += deltaTime;
+        m_iteration++;
+        frameIteration++;
+    }
+    PROFILE_POP();
+
+    printf(
+        "OK (average dt: %f s, %d MPM iterations, total simulated time: %f s)\n",
+        frameIteration ? frameTimeElapsed / (float) frameIteration : 0,
+        frameIteration, elapsedTime
+    );
+
+    // Compute level set for render
+    if (m_cpu_render) {
+        PROFILE_PUSH("Level set");
+        cpuMPM.ConvertMassToLevelSet(m_particleDensity);
+        cpuRender.UpdateVolume(cpuMPM.getGrid(), CHAN_LEVELSET, LEVELSET_BACKGROUND);
+        PROFILE_POP();
+    }
+}
 
+void Sample::render_update_gpu() {
     if (m_p2g_only) {
         printf("  P2G level set... ");
 
         // Rebuild GVDB Render topology
-        PERF_PUSH("Dynamic Topology");
+        PROFILE_PUSH("Dynamic Topology");
         gvdb.RebuildTopology(m_numpnts, 2.0, m_origin); // Allocate bricks so that all neighboring 3x3x3 voxels of a particle is covered
         gvdb.FinishTopology(false, true); // false. no commit pool	false. no compute bounds
         gvdb.UpdateAtlas();
-        PERF_POP();
+        PROFILE_POP();
 
         int levelSetChannel = 0;
         float radius = 1.0;
         Vector3DF offset(0.0, 0.0, 0.0);
 
-        cudaEvent_t p2gStart, p2gEnd;
-        cudaEventCreate(&p2gStart);
-        cudaEventCreate(&p2gEnd);
-
-        cudaEventRecord(p2gStart);
+        PROFILE_PUSH("P2G");
         if (m_p2g_algorithm == SCATTER) {
             gvdb.ClearChannel(1);
             gvdb.ScatterLevelSet(m_numpnts, radius, offset, 1);
             gvdb.CopyLinearChannelToTextureChannel(levelSetChannel, 1);
         } else if (m_p2g_algorithm == GATHER) {
             int scPntLen = 0;
-            int subcellSize = 4;
+            int subcellSize = m_subcell_size;
             gvdb.InsertPointsSubcell(subcellSize, m_numpnts, m_radius, m_origin, scPntLen);
             gvdb.GatherLevelSet(subcellSize, m_numpnts, radius, offset, scPntLen, levelSetChannel, -1, false);
         } else {
@@ -879,184 +1358,152 @@ void Sample::render_update() {
             gvdb.ScatterReduceLevelSet(m_numpnts, radius, offset, 1);
             gvdb.CopyLinearChannelToTextureChannel(levelSetChannel, 1);
         }
-        cudaEventRecord(p2gEnd);
-        float p2gDuration = getEventDuration(p2gStart, p2gEnd);
+        PROFILE_POP();
 
         gvdb.UpdateApron(levelSetChannel, 3.0f);
 
         m_iteration++;
-        printf("OK (%f ms)\n", p2gDuration);
+        printf("OK\n");
+        return;
+    }
 
-        cudaEventDestroy(p2gStart);
-        cudaEventDestroy(p2gEnd);
-    } else {
-        printf("  MPM... ");
-
-        cudaEvent_t frameStart, frameEnd;
-        cudaEvent_t topologyStart, topologyEnd, p2gStart, p2gEnd;
-        cudaEvent_t gridUpdateStart, gridUpdateEnd, g2pStart, g2pEnd;
-        cudaEventCreate(&frameStart);
-        cudaEventCreate(&frameEnd);
-        cudaEventCreate(&topologyStart);
-        cudaEventCreate(&topologyEnd);
-        cudaEventCreate(&p2gStart);
-        cudaEventCreate(&p2gEnd);
-        cudaEventCreate(&gridUpdateStart);
-        cudaEventCreate(&gridUpdateEnd);
-        cudaEventCreate(&g2pStart);
-        cudaEventCreate(&g2pEnd);
-        float topologyFrameDuration = 0.0;
-        float p2gFrameDuration = 0.0;
-        float gridUpdateFrameDuration = 0.0;
-        float g2pFrameDuration = 0.0;
-
-        cudaEventRecord(frameStart);
-
-        float frameTimeElapsed = 0.0;
-        float frameTimeTarget = 1.0 / simulationFPS;
-        int frameIteration = 0;
-
-        while (frameTimeElapsed < frameTimeTarget && m_active) {
-            if (m_iteration_limit && (m_iteration >= m_iteration_limit)) {
-                printf("\nReached iteration limit, stopping...\n");
-                m_active = false;
-                break;
-            }
+    printf("  MPM... ");
 
-            // Rebuild GVDB Render topology
-            PERF_PUSH("Dynamic Topology");
-            cudaEventRecord(topologyStart);
-            gvdb.RebuildTopology(m_numpnts, 2.0, m_origin); // Allocate bricks so that all neighboring 3x3x3 voxels of a particle is covered
-            gvdb.FinishTopology(false, true); // false. no commit pool	false. no compute bounds
-            gvdb.UpdateAtlas();
-            cudaEventRecord(topologyEnd);
-            topologyFrameDuration += getEventDuration(topologyStart, topologyEnd);
-            PERF_POP();
-
-            // Gather points to level set
-            PERF_PUSH("MPM");
-
-            // P2G
-            cudaEventRecord(p2gStart);
-            gvdb.ClearChannel(1);
-            gvdb.ClearChannel(2);
-            gvdb.ClearChannel(3);
-            gvdb.ClearChannel(4);
-            gvdb.ClearChannel(5);
-            gvdb.ClearChannel(6);
-            gvdb.ClearChannel(7);
-            if (m_p2g_algorithm == SCATTER) {
-                gvdb.P2G_ScatterAPIC(m_numpnts, m_particleInitialVolume, 7, 1, 4);
-            } else if (m_p2g_algorithm == GATHER) {
-                gvdb.P2G_GatherAPIC(m_numpnts, m_particleInitialVolume, 7, 1, 4);
-            } else {
-                gvdb.P2G_ScatterReduceAPIC(m_numpnts, m_particleInitialVolume, 7, 1, 4);
-            }
-            cudaEventRecord(p2gEnd);
-            p2gFrameDuration += getEventDuration(p2gStart, p2gEnd);
-
-            // Add external forces, handle collisions, update grid velocity
-            cudaEventRecord(gridUpdateStart);
-            gvdb.MPM_GridUpdate(deltaTime, 7, 1, 4);
-            cudaEventRecord(gridUpdateEnd);
-            gridUpdateFrameDuration += getEventDuration(gridUpdateStart, gridUpdateEnd);
-
-            // G2P and particle advection
-            cudaEventRecord(g2pStart);
-            gvdb.G2P_GatherAPIC(m_numpnts, deltaTime, 1);
-            cudaEventRecord(g2pEnd);
-            g2pFrameDuration += getEventDuration(g2pStart, g2pEnd);
-
-            // Calculate delta time based on maximum particle speeds
-            gvdb.GetMinMaxVel(m_numpnts);
-            Vector3DF cellDimension = Vector3DF(gvdb.getRange(0)) * gvdb.mVoxsize / Vector3DF(gvdb.getRes3DI(0));
-            Vector3DF maxParticleSpeeds(
-                gvdb.mVelMax.x > -gvdb.mVelMin.x ? gvdb.mVelMax.x : -gvdb.mVelMin.x,
-                gvdb.mVelMax.y > -gvdb.mVelMin.y ? gvdb.mVelMax.y : -gvdb.mVelMin.y,
-                gvdb.mVelMax.z > -gvdb.mVelMin.z ? gvdb.mVelMax.z : -gvdb.mVelMin.z
-            );
-            float maxParticleSpeed = maxParticleSpeeds.x > maxParticleSpeeds.y
-                ? (maxParticleSpeeds.x > maxParticleSpeeds.z ? maxParticleSpeeds.x : maxParticleSpeeds.z)
-                : (maxParticleSpeeds.y > maxParticleSpeeds.z ? maxParticleSpeeds.y : maxParticleSpeeds.z);
-            maxParticleSpeed *= 100.0; // Convert m/s to cm/s (grid units use cm)
-            if (maxParticleSpeed < 1e-6) maxParticleSpeed = 1e-6;
-            float calculatedDeltaTime = 0.01 * (cellDimension.x / maxParticleSpeed);
-
-            /*
-            // DEBUG
-            printf("Max speeds: %f %f %f\n", maxParticleSpeeds.x, maxParticleSpeeds.y, maxParticleSpeeds.z);
-            printf("Calculated delta time: %f\n", calculatedDeltaTime);
-            */
-
-            // Update delta time based on calculation delta time and remaining time to next frame
-            if (calculatedDeltaTime > 1e-4) calculatedDeltaTime = 1e-4; // Limit delta time maximum
-            if (frameTimeElapsed + calculatedDeltaTime > frameTimeTarget) {
-                deltaTime = frameTimeTarget - frameTimeElapsed;
-            } else if (frameTimeElapsed + 1.8*calculatedDeltaTime > frameTimeTarget) {
-                deltaTime = (frameTimeTarget - frameTimeElapsed) / 2.0;
-            } else {
-                deltaTime = calculatedDeltaTime;
-            }
-
-            PERF_POP();
+    float frameTimeElapsed = 0.0;
+    float frameTimeTarget = 1.0 / simulationFPS;
+    int frameIteration = 0;
 
-            elapsedTime += deltaTime;
-            frameTimeElapsed += deltaTime;
-            m_iteration++;
-            frameIteration++;
+    PROFILE_PUSH("Frame");
+    while (frameTimeElapsed < frameTimeTarget && m_active) {
+        if (m_iteration_limit && (m_iteration >= m_iteration_limit)) {
+            printf("\nReached iteration limit, stopping...\n");
+            m_active = false;
+            break;
         }
-        cudaEventRecord(frameStart);
-        float frameDuration = getEventDuration(frameStart, frameEnd);
+        profiler.SetContext(m_frame, m_iteration, m_numpnts);
+        sort_particles();
 
-        printf(
-            "OK (average dt: %f s, %d MPM iterations, total simulated time: %f s)\n",
-            frameIteration ? frameTimeElapsed / (float) frameIteration : 0,
-            frameIteration, elapsedTime
-        );
-        printf(
-            "    Topology rebuild : %f ms\n    P2G              : %f ms\n    Grid update      : %f ms\n    G2P              : %f ms\n    Frame total      : %f ms\n",
-            topologyFrameDuration, p2gFrameDuration, gridUpdateFrameDuration, g2pFrameDuration, frameDuration
-        );
+        // Rebuild GVDB Render topology
+        PROFILE_PUSH("Dynamic Topology");
+        gvdb.RebuildTopology(m_numpnts, 2.0, m_origin); // Allocate bricks so that all neighboring 3x3x3 voxels of a particle is covered
+        gvdb.FinishTopology(false, true); // false. no commit pool	false. no compute bounds
+        gvdb.UpdateAtlas();
+        PROFILE_POP();
+
+        // Gather points to level set
+        PROFILE_PUSH("MPM");
+
+        // P2G
+        PROFILE_PUSH("P2G");
+        gvdb.ClearChannel(1);
+        gvdb.ClearChannel(2);
+        gvdb.ClearChannel(3);
+        gvdb.ClearChannel(4);
+        gvdb.ClearChannel(5);
+        gvdb.ClearChannel(6);
+        gvdb.ClearChannel(7);
+        if (m_p2g_algorithm == SCATTER) {
+            gvdb.P2G_ScatterAPIC(m_numpnts, m_particleInitialVolume, 7, 1, 4);
+        } else if (m_p2g_algorithm == GATHER) {
+            gvdb.P2G_GatherAPIC(m_numpnts, m_particleInitialVolume, 7, 1, 4);
+        } else {
+            gvdb.P2G_ScatterReduceAPIC(m_numpnts, m_particleInitialVolume, 7, 1, 4);
+        }
+        PROFILE_POP();
+
+        // Add external forces, handle collisions, update grid velocity
+        PROFILE_PUSH("Grid update");
+        gvdb.MPM_GridUpdate(deltaTime, 7, 1, 4);
+        PROFILE_POP();
+
+        // G2P and particle advection
+        PROFILE_PUSH("G2P");
+        gvdb.G2P_GatherAPIC(m_numpnts, deltaTime, 1);
+        PROFILE_POP();
+
+        // Calculate delta time based on maximum particle speeds
+        PROFILE_PUSH("CFL");
+        gvdb.GetMinMaxVel(m_numpnts);
+        Vector3DF cellDimension = Vector3DF(gvdb.getRange(0)) * gvdb.mVoxsize / Vector3DF(gvdb.getRes3DI(0));
+        update_delta_time(gvdb.mVelMin, gvdb.mVelMax, cellDimension.x, frameTimeElapsed,
+                          frameTimeTarget);
+        PROFILE_POP();
+
+        PROFILE_POP();
+
+        elapsedTime += deltaTime;
+        frameTimeElapsed += deltaTime;
+        m_iteration++;
+        frameIteration++;
+    }
+    PROFILE_POP();
+
+    printf(
+        "OK (average dt: %f s, %d MPM iterations, total simulated time: %f s)\n",
+        frameIteration ? frameTimeElapsed / (float) frameIteration : 0,
+        frameIteration, elapsedTime
+    );
+
+    // Compute level set for render
+    PROFILE_PUSH("Level set");
+    gvdb.ConvertLinearMassChannelToTextureLevelSetChannel(0, 7);
+    gvdb.UpdateApron(0, 3.0f);
+    PROFILE_POP();
+}
 
-        // Compute level set for render
-        cudaEvent_t levelSetStart, levelSetEnd;
-        cudaEventCreate(&levelSetStart);
-        cudaEventCreate(&levelSetEnd);
-        printf("  Computing level set... ");
-        cudaEventRecord(levelSetStart);
-        gvdb.ConvertLinearMassChannelToTextureLevelSetChannel(0, 7);
-        gvdb.UpdateApron(0, 3.0f);
-        cudaEventRecord(levelSetEnd);
-        printf("OK (%f ms)\n", getEventDuration(levelSetStart, levelSetEnd));
-
-        cudaEventDestroy(frameStart);
-        cudaEventDestroy(frameEnd);
-        cudaEventDestroy(topologyStart);
-        cudaEventDestroy(topologyEnd);
-        cudaEventDestroy(p2gStart);
-        cudaEventDestroy(p2gEnd);
-        cudaEventDestroy(gridUpdateStart);
-        cudaEventDestroy(gridUpdateEnd);
-        cudaEventDestroy(g2pStart);
-        cudaEventDestroy(g2pEnd);
-        cudaEventDestroy(levelSetStart);
-        cudaEventDestroy(levelSetEnd);
+void Sample::render_update() {
+    if (m_frame_limit && (m_frame >= m_frame_limit)) {
+        printf("\nReached frame limit, stopping...\n");
+        m_active = false;
+        report_run();
+        return;
     }
 
-    if (m_render_optix) {
-        PERF_PUSH("Update OptiX");
-        optx.UpdateVolume(&gvdb); // GVDB topology has changed
-        PERF_POP();
+    if (!m_pnton)
+        return;
+
+    printf("\n[Frame %d] \n", m_frame);
+    profiler.SetContext(m_frame, m_iteration, m_numpnts);
+
+    if (m_backend == BACKEND_CPU) {
+        render_update_cpu();
+    } else {
+        cuProfilerStart();
+        render_update_gpu();
+
+        if (m_render_optix) {
+            PROFILE_PUSH("Update OptiX");
+            optx.UpdateVolume(&gvdb); // GVDB topology has changed
+            PROFILE_POP();
+        }
+
+        cuProfilerStop();
     }
 
-    cuProfilerStop();
+    // Collect this frame's timers, one synchronization for the whole frame
+    profiler.Resolve();
+
+    float memory = measure_memory();
+    if (memory > m_peak_memory)
+        m_peak_memory = memory;
 
     // Print detailed info when rendering every frame
     if (m_info) {
         printf("  Info:\n");
+        printf(
+            "    Topology rebuild : %f ms\n    P2G              : %f ms\n    Grid update      : %f ms\n    G2P              : %f ms\n    Level set        : %f ms\n    Frame total      : %f ms\n",
+            profiler.getLastTotal("Dynamic Topology"), profiler.getLastTotal("P2G"),
+            profiler.getLastTotal("Grid update"), profiler.getLastTotal("G2P"),
+            profiler.getLastTotal("Level set"), profiler.getLastTotal("Frame")
+        );
         ReportMemory();
-        gvdb.Measure(true);
+        if (m_backend == BACKEND_GPU)
+            gvdb.Measure(true);
     }
+
+    // Iteration limit was reached during this frame
+    if (!m_active)
+        report_run();
 }
 
 void Sample::render_frame() {
@@ -1087,24 +1534,101 @@ void Sample::render_frame() {
 
     if (m_render_optix) {
         // OptiX render
-        PERF_PUSH("Raytrace");
+        PROFILE_PUSH("Raytrace");
         optx.Render(&gvdb, SHADE_LEVELSET, 0);
-        PERF_POP();
-        PERF_PUSH("ReadToGL");
+        PROFILE_POP();
+        PROFILE_PUSH("ReadToGL");
         optx.ReadOutputTex(gl_screen_tex);
-        PERF_POP();
+        PROFILE_POP();
+    } else if (m_backend == BACKEND_CPU) {
+        if (!m_cpu_render)
+            return;
+        // CPU ray marcher, one deterministic sample per pixel
+        render_cpu();
+        PROFILE_PUSH("ReadToGL");
+        glBindTexture(GL_TEXTURE_2D, gl_screen_tex);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F_ARB, m_w, m_h, 0, GL_RGB, GL_FLOAT,
+                     &m_frame_pixels[0]);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        PROFILE_POP();
     } else {
         // CUDA render
-        PERF_PUSH("Raytrace");
+        PROFILE_PUSH("Raytrace");
         gvdb.Render(sh, 0, 0);
-        PERF_POP();
-        PERF_PUSH("ReadToGL");
+        PROFILE_POP();
+        PROFILE_PUSH("ReadToGL");
         gvdb.ReadRenderTexGL(0, gl_screen_tex);
-        PERF_POP();
+        PROFILE_POP();
     }
     renderScreenQuadGL(gl_screen_tex); // Render screen-space quad with texture
 }
 
+// Render the level set of the CPU backend into m_frame_pixels with the scene camera, light,
+// background and particle material
+void Sample::render_cpu() {
+    Camera3D *cam = gvdb.getScene()->getCamera();
+    float aspect = (float)m_w / m_h;
+    if (cam->getAspect() != aspect)
+        cam->setAspect(aspect);
+
+    RenderCamera view;
+    Vector3DF corner = cam->tlRayWorld;
+    Vector3DF u = cam->trRayWorld;
+    Vector3DF v = cam->blRayWorld;
+    u -= corner;
+    v -= corner;
+    for (int a = 0; a < 3; a++) {
+        view.pos[a] = (&cam->getPos().x)[a];
+        view.corner[a] = (&corner.x)[a];
+        view.u[a] = (&u.x)[a];
+        view.v[a] = (&v.x)[a];
+    }
+    cpuRender.SetCamera(view);
+    cpuRender.SetLight(&gvdb.getScene()->getLight()->getPos().x);
+    cpuRender.SetBackground(&m_backclr.x);
+    cpuRender.SetStep(m_render_step);
+
+    if (m_pntmat < (int)mat_list.size()) {
+        const MaterialParams &p = mat_list[m_pntmat];
+        RenderMaterial mat;
+        for (int a = 0; a < 3; a++) {
+            mat.ambColor[a] = (&p.amb_color.x)[a];
+            mat.diffColor[a] = (&p.diff_color.x)[a];
+            mat.specColor[a] = (&p.spec_color.x)[a];
+            mat.envColor[a] = (&p.env_color.x)[a];
+            mat.reflColor[a] = (&p.refl_color.x)[a];
+            mat.refrColor[a] = (&p.refr_color.x)[a];
+        }
+        mat.specPower = p.spec_power;
+        mat.shadowBias = p.shadow_bias;
+        mat.reflWidth = p.refl_width;
+        mat.reflBias = p.refl_bias;
+        mat.refrWidth = p.refr_width;
+        mat.refrIor = p.refr_ior;
+        mat.refrAmount = p.refr_amount;
+        mat.refrOffset = p.refr_offset;
+        mat.refrBias = p.refr_bias;
+        cpuRender.SetMaterial(mat);
+    }
+
+    PROFILE_PUSH("Raytrace");
+    cpuRender.Render(m_frame_pixels, m_w, m_h);
+    PROFILE_POP();
+}
+
+// Hand m_frame_pixels (w x h, the size it was rendered or read back at) to the background PNG
+// writer. The buffer is swapped with a recycled one.
+void Sample::queue_png(int w, int h) {
+    char png_name[1024];
+    char pfmt[1024];
+    sprintf(pfmt, "%s%s", m_outpath.c_str(), m_outfile.c_str());
+    sprintf(png_name, pfmt, m_frame);
+    std::cout << "  Queueing png " << png_name << "\n";
+    frameWriter.SetLevel(m_png_level);
+    frameWriter.Submit(png_name, m_frame_pixels, w, h);
+}
+
 void Sample::draw_topology() {
     Vector3DF clrs[10];
     clrs[0] = Vector3DF(0, 0, 1);          // blue
@@ -1170,26 +1694,25 @@ void Sample::display() {
     // Render frame
     render_frame();
 
+    // The CPU ray marcher does not accumulate samples
+    int maxSamples = m_cpu_render ? 1 : m_max_samples;
     if (m_sample % 8 == 0 && m_sample > 0) {
-        int pct = (m_sample * 100) / m_max_samples;
+        int pct = (m_sample * 100) / maxSamples;
         nvprintf("%d%%%% ", pct);
     } else if (m_sample == 0) {
-        nvprintf("  Rendering... (samples: %d) ", m_max_samples);
+        nvprintf("  Rendering... (samples: %d) ", maxSamples);
     }
 
-    if (++m_sample >= m_max_samples) {
+    if (++m_sample >= maxSamples) {
         m_sample = 0;
         nvprintf("OK\n");
 
         if (m_save_png && m_render_optix) {
-            // Save current frame to PNG
-            char png_name[1024];
-            char pfmt[1024];
-            sprintf(pfmt, "%s%s", m_outpath.c_str(), m_outfile.c_str());
-            sprintf(png_name, pfmt, m_frame);
-            std::cout << "  Saving png to " << png_name << "... ";
-            optx.SaveOutput(png_name);
-            std::cout << "OK\n";
+            int w, h;
+            optx.ReadOutput(m_frame_pixels, w, h);
+            queue_png(w, h);
+        } else if (m_save_png && m_cpu_render) {
+            queue_png(m_w, m_h); // render_cpu renders at m_w x m_h
         }
 
         m_frame += m_fstep;
@@ -1280,7 +1803,41 @@ void Sample::mouse(NVPWindow::MouseButton button, NVPWindow::ButtonAction state,
     mouse_down = (state == NVPWindow::BUTTON_PRESS) ? button : -1;
 }
 
+// Run the simulation in a plain loop without window, GL context or GUI (batch jobs)
+int Sample::run_headless(int argc, const char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            on_arg(argv[i], i + 1 < argc ? argv[i + 1] : "");
+            i++;
+        }
+    }
+    if (!m_frame_limit && !m_iteration_limit)
+        nvprintf("Warning: headless run without -frame-limit or -iteration-limit\n");
+
+    setWinSz(1280, 760);
+    m_active = true;
+    if (!init())
+        return EXIT_FAILURE;
+
+    // Same order as display(): render and save the current frame, starting with the one init()
+    // simulated, then advance
+    while (m_active) {
+        if (m_cpu_render) {
+            render_cpu();
+            if (m_save_png)
+                queue_png(m_w, m_h);
+        }
+        m_frame += m_fstep;
+        render_update();
+    }
+    return EXIT_SUCCESS;
+}
+
 int sample_main(int argc, const char **argv) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-headless") == 0 && strcmp(argv[i + 1], "0") != 0)
+            return sample_obj.run_headless(argc, argv);
+    }
     return sample_obj.run("p2g-scatter MPM", "p2g-scatter", argc, argv,
                           1280, 760, 4, 5, 30);
 }
@@ -0,0 +1,965 @@
+#include "mpm_cpu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <string.h>
+
+// Particles per parallelFor chunk; large enough to amortize scheduling, small enough to balance
+#define PARTICLE_GRAIN 4096
+#define BRICK_GRAIN 16
+
+#define NO_NODE ((size_t)-1) // Stencil node skipped by scatterParticle
+
+// Prefetch for writing, used where particles are visited in index order
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr, 1)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define PREFETCH(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+#define PREFETCH(addr)
+#endif
+
+static inline void atomicAddFloat(float *addr, float val) {
+    std::atomic<float> *a = reinterpret_cast<std::atomic<float> *>(addr);
+    float old = a->load(std::memory_order_relaxed);
+    while (!a->compare_exchange_weak(old, old + val, std::memory_order_relaxed)) {
+    }
+}
+
+// Flag brick b as written by P2G. Atomic scatter threads may flag the same brick.
+static inline void markBrick(unsigned char *touched, int b) {
+    std::atomic<unsigned char> *flag = reinterpret_cast<std::atomic<unsigned char> *>(touched + b);
+    if (!flag->load(std::memory_order_relaxed))
+        flag->store(1, std::memory_order_relaxed);
+}
+
+template <bool Atomic> static inline void addFloat(float *addr, float val) {
+    if (Atomic)
+        atomicAddFloat(addr, val);
+    else
+        *addr += val;
+}
+
+MPMSolverCPU::MPMSolverCPU() {
+    mParams.cellSize = 0.01f;
+    mParams.youngsModulus = 1.0e5f;
+    mParams.poissonRatio = 0.3f;
+    mParams.gravity[0] = 0.0f;
+    mParams.gravity[1] = -9.8f;
+    mParams.gravity[2] = 0.0f;
+    mParams.groundHeight = 5.0f; // Matches ground.obj offset in the sample scenes
+    for (int a = 0; a < 3; a++) {
+        mParams.domainMin[a] = 0.0f;
+        mParams.domainMax[a] = 256.0f;
+        mVelMin[a] = 0.0f;
+        mVelMax[a] = 0.0f;
+    }
+    mGrid.Configure(3, 3, 3, 3, 3); // 8^3 bricks, as the GVDB grid in Sample::init
+    mSubcellLog2 = 2;
+    mBinsValid = false;
+    mSimdLevel = getBestSimdLevel();
+    SetKernel(KERNEL_QUADRATIC, 3);
+    mRounding = ROUND_NEAREST;
+    mRoundingPass = 0;
+
+    mParticles = 0;
+}
+
+template <class S> void MPMSolverCPU::setTransfers() {
+    mTransfers.scatter = &MPMSolverCPU::scatterAPIC<S>;
+    mTransfers.coloredScatter = &MPMSolverCPU::coloredScatterAPIC<S>;
+    mTransfers.scatterReduce = &MPMSolverCPU::scatterReduceAPIC<S>;
+    mTransfers.gather = &MPMSolverCPU::gatherAPIC<S>;
+    mTransfers.g2p[CHANNEL_FP32] = &MPMSolverCPU::g2pAPIC<S, CHANNEL_FP32>;
+    mTransfers.g2p[CHANNEL_FP16] = &MPMSolverCPU::g2pAPIC<S, CHANNEL_FP16>;
+    mTransfers.g2p[CHANNEL_BF16] = &MPMSolverCPU::g2pAPIC<S, CHANNEL_BF16>;
+}
+
+void MPMSolverCPU::SetKernel(int order, int dim) {
+    mKernelOrder = std::max(KERNEL_LINEAR, std::min(order, KERNEL_CUBIC));
+    mDimension = dim == 2 ? 2 : 3;
+    switch (mKernelOrder * 10 + mDimension) {
+    case 12:
+        setTransfers<TransferStencil<KERNEL_LINEAR, 2> >();
+        break;
+    case 13:
+        setTransfers<TransferStencil<KERNEL_LINEAR, 3> >();
+        break;
+    case 22:
+        setTransfers<TransferStencil<KERNEL_QUADRATIC, 2> >();
+        break;
+    case 23:
+        setTransfers<TransferStencil<KERNEL_QUADRATIC, 3> >();
+        break;
+    case 32:
+        setTransfers<TransferStencil<KERNEL_CUBIC, 2> >();
+        break;
+    case 33:
+        setTransfers<TransferStencil<KERNEL_CUBIC, 3> >();
+        break;
+    }
+    mGrid.SetStencil(mKernelOrder, mDimension);
+    mBinsValid = false;
+}
+
+void MPMSolverCPU::SetSimdLevel(int level) {
+    mSimdLevel = std::max(SIMD_SCALAR, std::min(level, getBestSimdLevel()));
+}
+
+void MPMSolverCPU::SetThreads(int numThreads) {
+    mPool.reset(new ThreadPool(numThreads));
+    mGrid.SetPool(mPool.get());
+}
+
+template <typename T>
+void MPMSolverCPU::getParticleStreams(T *pos[3], T *vel[3], T *def[9], T *aff[9]) {
+    for (int a = 0; a < 3; a++) {
+        pos[a] = mParticles->getComponent(PARTICLE_POSITION, a);
+        vel[a] = mParticles->getComponent(PARTICLE_VELOCITY, a);
+    }
+    for (int k = 0; k < 9; k++) {
+        def[k] = mParticles->getComponent(PARTICLE_DEFORMATION, k);
+        aff[k] = mParticles->getComponent(PARTICLE_AFFINE, k);
+    }
+}
+
+bool MPMSolverCPU::RebuildTopology(int numPoints) {
+    mBinsValid = false;
+    mActiveBricks.clear();
+    if (numPoints <= 0)
+        return true;
+    return mGrid.RebuildTopology(*mParticles);
+}
+
+void MPMSolverCPU::ClearChannels() { mGrid.ClearChannels(); }
+
+void MPMSolverCPU::SetChannelFormat(int chan, int format) {
+    if (chan != CHAN_MOMENTUM && chan != CHAN_FORCE)
+        return;
+    format = std::max(CHANNEL_FP32, std::min(format, CHANNEL_BF16));
+    for (int a = 0; a < 3; a++)
+        mGrid.SetChannelFormat(chan + a, format);
+}
+
+void MPMSolverCPU::storeBrickNodes(int b, int chan, int local, int count, const float *src,
+                                   uint32_t seed) {
+    StoreChannel(mGrid.getChannelData(chan), mGrid.getChannelFormat(chan),
+                 (size_t)b * mGrid.getBrickNodes() + local, count, src, mRounding, seed + chan);
+}
+
+// Stencils of a batch of particles. Quadratic 3D stencils come from the SIMD kernels, the
+// other specializations are computed here.
+template <class S>
+static void computeStencils(const BSplineKernels &kernels, const float *const pos[3],
+                            const int *indices, int first, int count, typename S::Batch &s) {
+    for (int lane = 0; lane < count; lane++) {
+        int p = indices ? indices[lane] : first + lane;
+        for (int a = 0; a < 3; a++) {
+            if (S::size(a) == 1) {
+                // 2D: the particle sits on its nearest z plane
+                s.base[a][lane] = (int)std::floor(pos[a][p] + 0.5f);
+                s.fx[a][lane] = 0.0f;
+                s.w[a][0][lane] = 1.0f;
+                s.dw[a][0][lane] = 0.0f;
+                continue;
+            }
+            float base = std::floor(pos[a][p] - S::Spline::shift());
+            float w[S::SIZE], dw[S::SIZE];
+            S::Spline::weights(pos[a][p] - base, w, dw);
+            s.base[a][lane] = (int)base;
+            s.fx[a][lane] = pos[a][p] - base;
+            for (int i = 0; i < S::SIZE; i++) {
+                s.w[a][i][lane] = w[i];
+                s.dw[a][i][lane] = dw[i];
+            }
+        }
+    }
+}
+
+template <>
+void computeStencils<TransferStencil<KERNEL_QUADRATIC, 3> >(const BSplineKernels &kernels,
+                                                            const float *const pos[3],
+                                                            const int *indices, int first,
+                                                            int count, StencilBatch &s) {
+    kernels.ComputeStencils(pos, indices, first, count, s);
+}
+
+template <class S>
+void MPMSolverCPU::getStencilNodes(const typename S::Batch &s, int lane, size_t *nodes,
+                                   ThreadBricks *local, unsigned char *touched) {
+    const int log2 = mGrid.getBrickLog2();
+    const int res = mGrid.getBrickRes();
+    const size_t brickNodes = mGrid.getBrickNodes();
+    const size_t brickStride = local ? P2G_CHANNELS * brickNodes : brickNodes;
+
+    // Brick and position inside the brick of the stencil nodes along each axis
+    int brick[3][S::SIZE], offset[3][S::SIZE];
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < S::size(a); i++) {
+            brick[a][i] = (s.base[a][lane] + i) >> log2;
+            offset[a][i] = (s.base[a][lane] + i) & (res - 1);
+        }
+    }
+
+    // The stencil spans at most 2 bricks per axis
+    int bricks[2][2][2];
+    for (int z = 0; z <= brick[2][S::SIZE_Z - 1] - brick[2][0]; z++)
+        for (int y = 0; y <= brick[1][S::SIZE - 1] - brick[1][0]; y++)
+            for (int x = 0; x <= brick[0][S::SIZE - 1] - brick[0][0]; x++) {
+                int b = mGrid.FindBrick(brick[0][0] + x, brick[1][0] + y, brick[2][0] + z);
+                if (touched)
+                    markBrick(touched, b);
+                if (local) {
+                    if (local->slots[b] < 0) {
+                        local->slots[b] = (int)local->bricks.size();
+                        local->bricks.push_back(b);
+                        local->data.resize(local->data.size() + brickStride, 0.0f);
+                    }
+                    b = local->slots[b];
+                }
+                bricks[z][y][x] = b;
+            }
+
+    for (int i = 0; i < S::SIZE; i++) {
+        for (int j = 0; j < S::SIZE; j++) {
+            for (int k = 0; k < S::SIZE_Z; k++) {
+                int b = bricks[brick[2][k] - brick[2][0]][brick[1][j] - brick[1][0]]
+                              [brick[0][i] - brick[0][0]];
+                nodes[(i * S::SIZE + j) * S::SIZE_Z + k] =
+                    b * brickStride + (offset[2][k] * res + offset[1][j]) * res + offset[0][i];
+            }
+        }
+    }
+}
+
+// Particle and grid arrays of a P2G transfer
+struct P2GArgs {
+    const float *pos[3];
+    P2GTermsParams terms;
+    float *gridMass, *mom[3], *force[3];
+};
+
+void MPMSolverCPU::getP2GArgs(float particleVolume, P2GArgs &args) {
+    const float E = mParams.youngsModulus, nu = mParams.poissonRatio;
+    P2GTermsParams &terms = args.terms;
+    terms.dx = mParams.cellSize;
+    terms.mu = E / (2.0f * (1.0f + nu));
+    terms.lambda = E * nu / ((1.0f + nu) * (1.0f - 2.0f * nu));
+    terms.particleVolume = particleVolume;
+
+    getParticleStreams(args.pos, terms.vel, terms.def, terms.aff);
+    terms.mass = mParticles->getComponent(PARTICLE_MASS, 0);
+
+    args.gridMass = getChannel(CHAN_MASS);
+    for (int a = 0; a < 3; a++) {
+        args.mom[a] = getChannel(CHAN_MOMENTUM + a);
+        args.force[a] = getChannel(CHAN_FORCE + a);
+    }
+}
+
+// Mass, APIC momentum and elastic force of particle `lane` of a batch on its stencil nodes
+template <class S, bool Atomic>
+static inline void scatterParticle(const P2GArgs &args, const typename S::Batch &s,
+                                   const P2GTermsBatch &t, int lane, const size_t *nodes) {
+    float mp = t.mass[lane];
+    float momentum[3], affine[9], stress[9];
+    for (int a = 0; a < 3; a++)
+        momentum[a] = t.momentum[a][lane];
+    for (int k = 0; k < 9; k++) {
+        affine[k] = t.affine[k][lane];
+        stress[k] = t.stress[k][lane];
+    }
+
+    for (int i = 0; i < S::SIZE; i++) {
+        for (int j = 0; j < S::SIZE; j++) {
+            for (int k = 0; k < S::SIZE_Z; k++) {
+                size_t n = nodes[(i * S::SIZE + j) * S::SIZE_Z + k];
+                if (n == NO_NODE)
+                    continue;
+
+                float wx = s.w[0][i][lane], wy = s.w[1][j][lane], wz = s.w[2][k][lane];
+                float w = wx * wy * wz;
+                float gradW[3] = {s.dw[0][i][lane] * wy * wz, wx * s.dw[1][j][lane] * wz,
+                                  wx * wy * s.dw[2][k][lane]};
+
+                addFloat<Atomic>(&args.gridMass[n], w * mp);
+                for (int a = 0; a < 3; a++) {
+                    float apic = momentum[a] + affine[a * 3 + 0] * i + affine[a * 3 + 1] * j +
+                                 affine[a * 3 + 2] * k;
+                    addFloat<Atomic>(&args.mom[a][n], w * apic);
+                    float f = stress[a * 3 + 0] * gradW[0] + stress[a * 3 + 1] * gradW[1] +
+                              stress[a * 3 + 2] * gradW[2];
+                    addFloat<Atomic>(&args.force[a][n], f);
+                }
+            }
+        }
+    }
+}
+
+void MPMSolverCPU::runP2G(void (MPMSolverCPU::*transfer)(int, float), int numPoints,
+                          float particleVolume) {
+    const int numBricks = mGrid.getNumBricks();
+    mBrickTouched.assign(numBricks, 0);
+    // Only the reduction and the gather write every node once, with a float sum at hand
+    if (mGrid.hasReducedChannels() && transfer != mTransfers.gather)
+        transfer = mTransfers.scatterReduce;
+    (this->*transfer)(numPoints, particleVolume);
+
+    mActiveBricks.clear();
+    for (int b = 0; b < numBricks; b++) {
+        if (mBrickTouched[b])
+            mActiveBricks.push_back(b);
+    }
+}
+
+void MPMSolverCPU::P2G_ScatterAPIC(int numPoints, float particleVolume) {
+    runP2G(mTransfers.scatter, numPoints, particleVolume);
+}
+
+template <class S> void MPMSolverCPU::scatterAPIC(int numPoints, float particleVolume) {
+    P2GArgs args;
+    getP2GArgs(particleVolume, args);
+    const BSplineKernels &kernels = getBSplineKernels(mSimdLevel);
+
+    mPool->parallelFor(numPoints, PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        typename S::Batch s;
+        P2GTermsBatch t;
+        for (int first = begin; first < end; first += STENCIL_BATCH) {
+            int count = std::min(STENCIL_BATCH, end - first);
+            computeStencils<S>(kernels, args.pos, 0, first, count, s);
+            kernels.ComputeP2GTerms(args.terms, 0, first, count, s.fx, t);
+            for (int lane = 0; lane < count; lane++) {
+                size_t nodes[S::NODES];
+                getStencilNodes<S>(s, lane, nodes, 0, &mBrickTouched[0]);
+                scatterParticle<S, true>(args, s, t, lane, nodes);
+            }
+        }
+    });
+}
+
+void MPMSolverCPU::SetSubcellSize(int size) {
+    mSubcellLog2 = 0;
+    while ((2 << mSubcellLog2) <= size && mSubcellLog2 < mGrid.getBrickLog2())
+        mSubcellLog2++;
+    mBinsValid = false;
+}
+
+void MPMSolverCPU::BinParticles(int numPoints) {
+    if (mBinsValid)
+        return;
+
+    const int numBricks = mGrid.getNumBricks();
+    const int log2 = mGrid.getBrickLog2();
+    const int subLog2 = log2 - mSubcellLog2; // Subcells per brick axis, log2
+    const int subcellsPerBrick = 1 << (3 * subLog2);
+    const float *pos[3] = {mParticles->getComponent(PARTICLE_POSITION, 0),
+                           mParticles->getComponent(PARTICLE_POSITION, 1),
+                           mParticles->getComponent(PARTICLE_POSITION, 2)};
+
+    // Pass 1: counting sort by brick. Fixed particle blocks (not pool chunks) keep the bin
+    // order independent of scheduling.
+    const int numBlocks = mPool->getNumThreads();
+    const int blockSize = (numPoints + numBlocks - 1) / numBlocks;
+    mParticleBins.resize(numPoints);
+    mBinCounts.assign((size_t)numBlocks * numBricks, 0);
+
+    mPool->parallelFor(numBlocks, 1, [&](int begin, int end, int thread) {
+        for (int block = begin; block < end; block++) {
+            int *counts = &mBinCounts[(size_t)block * numBricks];
+            int last = std::min(numPoints, (block + 1) * blockSize);
+            for (int p = block * blockSize; p < last; p++) {
+                int base[3];
+                for (int a = 0; a < 3; a++)
+                    base[a] = mGrid.getStencilBase(pos[a][p], a) >> mSubcellLog2;
+                int b = mGrid.FindBrick(base[0] >> subLog2, base[1] >> subLog2,
+                                        base[2] >> subLog2);
+                int mask = (1 << subLog2) - 1;
+                int subcell = (((base[2] & mask) << subLog2 | (base[1] & mask)) << subLog2) |
+                              (base[0] & mask);
+                mParticleBins[p] = b * subcellsPerBrick + subcell;
+                counts[b]++;
+            }
+        }
+    });
+
+    // Brick-major exclusive prefix sum, the counts become each block's write offsets
+    mBrickOffsets.resize(numBricks + 1);
+    int offset = 0;
+    for (int b = 0; b < numBricks; b++) {
+        mBrickOffsets[b] = offset;
+        for (int block = 0; block < numBlocks; block++) {
+            int &count = mBinCounts[(size_t)block * numBricks + b];
+            int blockCount = count;
+            count = offset;
+            offset += blockCount;
+        }
+    }
+    mBrickOffsets[numBricks] = offset;
+
+    std::vector<int> &byBrick = subcellsPerBrick > 1 ? mBrickParticles : mBinParticles;
+    byBrick.resize(numPoints);
+    mPool->parallelFor(numBlocks, 1, [&](int begin, int end, int thread) {
+        for (int block = begin; block < end; block++) {
+            int *offsets = &mBinCounts[(size_t)block * numBricks];
+            int last = std::min(numPoints, (block + 1) * blockSize);
+            for (int p = block * blockSize; p < last; p++)
+                byBrick[offsets[mParticleBins[p] / subcellsPerBrick]++] = p;
+        }
+    });
+
+    // Pass 2: stable counting sort of every brick's particles by subcell
+    mBinOffsets.resize((size_t)numBricks * subcellsPerBrick + 1);
+    mBinOffsets[(size_t)numBricks * subcellsPerBrick] = numPoints;
+    if (subcellsPerBrick == 1) {
+        std::copy(mBrickOffsets.begin(), mBrickOffsets.end(), mBinOffsets.begin());
+    } else {
+        mBinParticles.resize(numPoints);
+        mPool->parallelFor(numBricks, BRICK_GRAIN, [&](int begin, int end, int thread) {
+            std::vector<int> counts(subcellsPerBrick);
+            for (int b = begin; b < end; b++) {
+                int first = b * subcellsPerBrick;
+                std::fill(counts.begin(), counts.end(), 0);
+                for (int k = mBrickOffsets[b]; k < mBrickOffsets[b + 1]; k++)
+                    counts[mParticleBins[mBrickParticles[k]] - first]++;
+                int offset = mBrickOffsets[b];
+                for (int c = 0; c < subcellsPerBrick; c++) {
+                    mBinOffsets[first + c] = offset;
+                    offset += counts[c];
+                    counts[c] = mBinOffsets[first + c];
+                }
+                for (int k = mBrickOffsets[b]; k < mBrickOffsets[b + 1]; k++) {
+                    int p = mBrickParticles[k];
+                    mBinParticles[counts[mParticleBins[p] - first]++] = p;
+                }
+            }
+        });
+    }
+
+    for (int c = 0; c < 8; c++)
+        mColorBricks[c].clear();
+    for (int b = 0; b < numBricks; b++) {
+        if (mBrickOffsets[b] == mBrickOffsets[b + 1])
+            continue;
+        const int *coord = mGrid.getBrickCoord(b);
+        mColorBricks[(coord[2] & 1) << 2 | (coord[1] & 1) << 1 | (coord[0] & 1)].push_back(b);
+    }
+    mBinsValid = true;
+}
+
+void MPMSolverCPU::P2G_ColoredScatterAPIC(int numPoints, float particleVolume) {
+    runP2G(mTransfers.coloredScatter, numPoints, particleVolume);
+}
+
+template <class S> void MPMSolverCPU::coloredScatterAPIC(int numPoints, float particleVolume) {
+    BinParticles(numPoints);
+
+    P2GArgs args;
+    getP2GArgs(particleVolume, args);
+    const BSplineKernels &kernels = getBSplineKernels(mSimdLevel);
+
+    // The stencil of a particle binned in brick b only reaches bricks b .. b + 1 along each
+    // axis, so bricks of the same colour are at least one brick apart
+    for (int c = 0; c < 8; c++) {
+        const std::vector<int> &bricks = mColorBricks[c];
+        mPool->parallelFor((int)bricks.size(), 1, [&](int begin, int end, int thread) {
+            typename S::Batch s;
+            P2GTermsBatch t;
+            for (int i = begin; i < end; i++) {
+                int b = bricks[i];
+                for (int k = mBrickOffsets[b]; k < mBrickOffsets[b + 1]; k += STENCIL_BATCH) {
+                    int count = std::min(STENCIL_BATCH, mBrickOffsets[b + 1] - k);
+                    const int *indices = &mBinParticles[k];
+                    computeStencils<S>(kernels, args.pos, indices, 0, count, s);
+                    kernels.ComputeP2GTerms(args.terms, indices, 0, count, s.fx, t);
+                    for (int lane = 0; lane < count; lane++) {
+                        size_t nodes[S::NODES];
+                        getStencilNodes<S>(s, lane, nodes, 0, &mBrickTouched[0]);
+                        scatterParticle<S, false>(args, s, t, lane, nodes);
+                    }
+                }
+            }
+        });
+    }
+}
+
+void MPMSolverCPU::P2G_ScatterReduceAPIC(int numPoints, float particleVolume) {
+    runP2G(mTransfers.scatterReduce, numPoints, particleVolume);
+}
+
+template <class S> void MPMSolverCPU::scatterReduceAPIC(int numPoints, float particleVolume) {
+    const int numThreads = mPool->getNumThreads();
+    const int numBricks = mGrid.getNumBricks();
+    const int brickNodes = mGrid.getBrickNodes();
+
+    // Buffers keep their capacity between steps
+    mThreadBricks.resize(numThreads);
+    for (int t = 0; t < numThreads; t++) {
+        mThreadBricks[t].slots.assign(numBricks, -1);
+        mThreadBricks[t].bricks.clear();
+        mThreadBricks[t].data.clear();
+    }
+
+    P2GArgs args;
+    getP2GArgs(particleVolume, args);
+    const BSplineKernels &kernels = getBSplineKernels(mSimdLevel);
+
+    mPool->parallelFor(numPoints, PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        ThreadBricks &local = mThreadBricks[thread];
+        P2GArgs localArgs = args;
+        typename S::Batch s;
+        P2GTermsBatch t;
+        for (int first = begin; first < end; first += STENCIL_BATCH) {
+            int count = std::min(STENCIL_BATCH, end - first);
+            computeStencils<S>(kernels, args.pos, 0, first, count, s);
+            kernels.ComputeP2GTerms(args.terms, 0, first, count, s.fx, t);
+            for (int lane = 0; lane < count; lane++) {
+                size_t nodes[S::NODES];
+                getStencilNodes<S>(s, lane, nodes, &local);
+
+                // The buffer may have grown
+                float *data = &local.data[0];
+                localArgs.gridMass = data;
+                for (int a = 0; a < 3; a++) {
+                    localArgs.mom[a] = data + (1 + a) * brickNodes;
+                    localArgs.force[a] = data + (4 + a) * brickNodes;
+                }
+                scatterParticle<S, false>(localArgs, s, t, lane, nodes);
+            }
+        }
+    });
+
+    // Grid channel of each block of a thread brick
+    const int chans[P2G_CHANNELS] = {CHAN_MASS, CHAN_MOMENTUM, CHAN_MOMENTUM + 1,
+                                     CHAN_MOMENTUM + 2, CHAN_FORCE, CHAN_FORCE + 1,
+                                     CHAN_FORCE + 2};
+    const uint32_t seed = nextRoundingSeed();
+    mPool->parallelFor(numBricks, BRICK_GRAIN, [&](int begin, int end, int thread) {
+        std::vector<float *> copies(numThreads);
+        for (int b = begin; b < end; b++) {
+            int numCopies = 0;
+            for (int t = 0; t < numThreads; t++) {
+                int slot = mThreadBricks[t].slots[b];
+                if (slot >= 0)
+                    copies[numCopies++] = &mThreadBricks[t].data[(size_t)slot * P2G_CHANNELS *
+                                                                 brickNodes];
+            }
+            if (numCopies == 0)
+                continue;
+            mBrickTouched[b] = 1;
+
+            // Pairwise tree sum of the thread copies into the first one
+            for (int stride = 1; stride < numCopies; stride *= 2) {
+                for (int i = 0; i + stride < numCopies; i += 2 * stride) {
+                    float *dst = copies[i];
+                    const float *src = copies[i + stride];
+                    for (int k = 0; k < P2G_CHANNELS * brickNodes; k++)
+                        dst[k] += src[k];
+                }
+            }
+            for (int c = 0; c < P2G_CHANNELS; c++)
+                storeBrickNodes(b, chans[c], 0, brickNodes, copies[0] + c * brickNodes, seed);
+        }
+    });
+}
+
+// Brick node index of the stencil nodes inside the subcell of `size` nodes starting at node lo,
+// NO_NODE outside
+template <class S>
+static inline void getSubcellNodes(const typename S::Batch &s, int lane, const int *lo, int size,
+                                   int res, size_t *nodes) {
+    int offset[3][S::SIZE];
+    bool inside[3][S::SIZE];
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < S::size(a); i++) {
+            int d = s.base[a][lane] + i - lo[a];
+            inside[a][i] = d >= 0 && d < size;
+            offset[a][i] = (lo[a] & (res - 1)) + d;
+        }
+    }
+    for (int i = 0; i < S::SIZE; i++) {
+        for (int j = 0; j < S::SIZE; j++) {
+            for (int k = 0; k < S::SIZE_Z; k++) {
+                nodes[(i * S::SIZE + j) * S::SIZE_Z + k] =
+                    inside[0][i] && inside[1][j] && inside[2][k]
+                        ? (offset[2][k] * res + offset[1][j]) * res + offset[0][i]
+                        : NO_NODE;
+            }
+        }
+    }
+}
+
+// Brick node index of the first node of row (y, z) of the subcell starting at node lo
+static inline int getSubcellRow(const int *lo, int y, int z, int res) {
+    return (((lo[2] & (res - 1)) + z) * res + (lo[1] & (res - 1)) + y) * res + (lo[0] & (res - 1));
+}
+
+void MPMSolverCPU::P2G_GatherAPIC(int numPoints, float particleVolume) {
+    runP2G(mTransfers.gather, numPoints, particleVolume);
+}
+
+template <class S> void MPMSolverCPU::gatherAPIC(int numPoints, float particleVolume) {
+    BinParticles(numPoints);
+
+    P2GArgs args;
+    getP2GArgs(particleVolume, args);
+    const BSplineKernels &kernels = getBSplineKernels(mSimdLevel);
+
+    const int log2 = mGrid.getBrickLog2();
+    const int res = mGrid.getBrickRes();
+    const int size = 1 << mSubcellLog2;
+    const int subLog2 = log2 - mSubcellLog2;
+    const int subMask = (1 << subLog2) - 1;
+    const int subcellsPerBrick = 1 << (3 * subLog2);
+    const int brickNodes = mGrid.getBrickNodes();
+
+    // Reduced channels are gathered into a float brick per thread, then rounded once per node
+    const bool staged = mGrid.hasReducedChannels();
+    const uint32_t seed = staged ? nextRoundingSeed() : 0;
+    const int chans[P2G_CHANNELS] = {CHAN_MASS, CHAN_MOMENTUM, CHAN_MOMENTUM + 1,
+                                     CHAN_MOMENTUM + 2, CHAN_FORCE, CHAN_FORCE + 1,
+                                     CHAN_FORCE + 2};
+    if (staged) {
+        mThreadBricks.resize(mPool->getNumThreads());
+        for (size_t t = 0; t < mThreadBricks.size(); t++)
+            mThreadBricks[t].data.resize((size_t)P2G_CHANNELS * brickNodes);
+    }
+
+    // One subcell of nodes per task. Particles with their first stencil node in
+    // [lo - SIZE + 1, lo + size) reach the subcell: 2x2x2 source subcells for quadratic
+    // stencils, or 27 cells for size 1.
+    mPool->parallelFor(mGrid.getNumBricks() * subcellsPerBrick, subcellsPerBrick,
+                       [&](int begin, int end, int thread) {
+        P2GArgs targetArgs = args;
+        typename S::Batch s;
+        P2GTermsBatch t;
+        for (int task = begin; task < end; task++) {
+            int b = task / subcellsPerBrick;
+            int subcell = task % subcellsPerBrick;
+            const int *brick = mGrid.getBrickCoord(b);
+            int lo[3], sub[3] = {subcell & subMask, (subcell >> subLog2) & subMask,
+                                 subcell >> (2 * subLog2)};
+            for (int a = 0; a < 3; a++)
+                lo[a] = brick[a] * res + sub[a] * size;
+
+            // Gather with the scatter kernel restricted to this subcell, which belongs to
+            // brick b only, so node indices are relative to the brick
+            float *stage = staged ? &mThreadBricks[thread].data[0] : 0;
+            if (staged) {
+                for (int c = 0; c < P2G_CHANNELS; c++) {
+                    for (int z = 0; z < size; z++) {
+                        for (int y = 0; y < size; y++)
+                            memset(stage + c * brickNodes + getSubcellRow(lo, y, z, res), 0,
+                                   size * sizeof(float));
+                    }
+                }
+                targetArgs.gridMass = stage;
+                for (int a = 0; a < 3; a++) {
+                    targetArgs.mom[a] = stage + (1 + a) * brickNodes;
+                    targetArgs.force[a] = stage + (4 + a) * brickNodes;
+                }
+            } else {
+                targetArgs.gridMass = mGrid.getBrickChannel(b, CHAN_MASS);
+                for (int a = 0; a < 3; a++) {
+                    targetArgs.mom[a] = mGrid.getBrickChannel(b, CHAN_MOMENTUM + a);
+                    targetArgs.force[a] = mGrid.getBrickChannel(b, CHAN_FORCE + a);
+                }
+            }
+
+            int srcLo[3], srcHi[3];
+            for (int a = 0; a < 3; a++) {
+                srcLo[a] = (lo[a] - S::size(a) + 1) >> mSubcellLog2;
+                srcHi[a] = lo[a] >> mSubcellLog2;
+            }
+            for (int sz = srcLo[2]; sz <= srcHi[2]; sz++) {
+                for (int sy = srcLo[1]; sy <= srcHi[1]; sy++) {
+                    for (int sx = srcLo[0]; sx <= srcHi[0]; sx++) {
+                        int sb = mGrid.FindBrick(sx >> subLog2, sy >> subLog2, sz >> subLog2);
+                        if (sb < 0)
+                            continue;
+                        int bin = sb * subcellsPerBrick +
+                                  ((((sz & subMask) << subLog2 | (sy & subMask)) << subLog2) |
+                                   (sx & subMask));
+                        if (mBinOffsets[bin] < mBinOffsets[bin + 1])
+                            markBrick(&mBrickTouched[0], b);
+                        for (int k = mBinOffsets[bin]; k < mBinOffsets[bin + 1];
+                             k += STENCIL_BATCH) {
+                            int count = std::min(STENCIL_BATCH, mBinOffsets[bin + 1] - k);
+                            const int *indices = &mBinParticles[k];
+                            computeStencils<S>(kernels, args.pos, indices, 0, count, s);
+                            kernels.ComputeP2GTerms(args.terms, indices, 0, count, s.fx, t);
+                            for (int lane = 0; lane < count; lane++) {
+                                size_t nodes[S::NODES];
+                                getSubcellNodes<S>(s, lane, lo, size, res, nodes);
+                                scatterParticle<S, false>(targetArgs, s, t, lane, nodes);
+                            }
+                        }
+                    }
+                }
+            }
+
+            // The subcell's nodes belong to this task only, so storing them adds to the
+            // cleared grid
+            if (staged) {
+                for (int c = 0; c < P2G_CHANNELS; c++) {
+                    for (int z = 0; z < size; z++) {
+                        for (int y = 0; y < size; y++) {
+                            int row = getSubcellRow(lo, y, z, res);
+                            storeBrickNodes(b, chans[c], row, size, stage + c * brickNodes + row,
+                                            seed);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+void MPMSolverCPU::MPM_GridUpdate(float deltaTime) {
+    const int res = mGrid.getBrickRes();
+    const int brickNodes = mGrid.getBrickNodes();
+    const int momFormat = mGrid.getChannelFormat(CHAN_MOMENTUM);
+    const int forceFormat = mGrid.getChannelFormat(CHAN_FORCE);
+    const uint32_t seed = momFormat != CHANNEL_FP32 ? nextRoundingSeed() : 0;
+
+    // Bricks outside the list have no mass, and their channels are still cleared
+    const int numActive = (int)mActiveBricks.size();
+    mPool->parallelFor(numActive, BRICK_GRAIN, [&](int begin, int end, int thread) {
+        // Reduced channels are converted to float bricks, fp32 ones are updated in place
+        std::vector<float> stage;
+        if (momFormat != CHANNEL_FP32 || forceFormat != CHANNEL_FP32)
+            stage.resize(6 * (size_t)brickNodes);
+        for (int i = begin; i < end; i++) {
+            int b = mActiveBricks[i];
+            const int *brick = mGrid.getBrickCoord(b);
+            const size_t first = (size_t)b * brickNodes;
+            const float *mass = mGrid.getBrickChannel(b, CHAN_MASS);
+            float *mom[3];
+            const float *force[3];
+            for (int a = 0; a < 3; a++) {
+                if (momFormat == CHANNEL_FP32) {
+                    mom[a] = mGrid.getBrickChannel(b, CHAN_MOMENTUM + a);
+                } else {
+                    mom[a] = &stage[a * brickNodes];
+                    LoadChannel(mGrid.getChannelData(CHAN_MOMENTUM + a), momFormat, first,
+                                brickNodes, mom[a]);
+                }
+                if (forceFormat == CHANNEL_FP32) {
+                    force[a] = mGrid.getBrickChannel(b, CHAN_FORCE + a);
+                } else {
+                    float *data = &stage[(3 + a) * brickNodes];
+                    LoadChannel(mGrid.getChannelData(CHAN_FORCE + a), forceFormat, first,
+                                brickNodes, data);
+                    force[a] = data;
+                }
+            }
+
+            for (int n = 0; n < brickNodes; n++) {
+                if (mass[n] <= 0.0f) {
+                    mom[0][n] = mom[1][n] = mom[2][n] = 0.0f;
+                    continue;
+                }
+
+                // Momentum to velocity, then external forces
+                float invMass = 1.0f / mass[n];
+                float v[3];
+                for (int a = 0; a < 3; a++)
+                    v[a] = (mom[a][n] + deltaTime * force[a][n]) * invMass +
+                           deltaTime * mParams.gravity[a];
+
+                // Collisions: separating ground plane and domain walls
+                int node[3] = {brick[0] * res + n % res, brick[1] * res + (n / res) % res,
+                               brick[2] * res + n / (res * res)};
+                if (node[1] < mParams.groundHeight && v[1] < 0.0f)
+                    v[1] = 0.0f;
+                for (int a = 0; a < 3; a++) {
+                    if (node[a] < mParams.domainMin[a] + 2.0f && v[a] < 0.0f)
+                        v[a] = 0.0f;
+                    if (node[a] > mParams.domainMax[a] - 2.0f && v[a] > 0.0f)
+                        v[a] = 0.0f;
+                }
+
+                mom[0][n] = v[0];
+                mom[1][n] = v[1];
+                mom[2][n] = v[2];
+            }
+
+            if (momFormat != CHANNEL_FP32) {
+                for (int a = 0; a < 3; a++)
+                    storeBrickNodes(b, CHAN_MOMENTUM + a, 0, brickNodes, mom[a], seed);
+            }
+        }
+    });
+}
+
+void MPMSolverCPU::ConvertMassToLevelSet(float density) {
+    const float *mass = getChannel(CHAN_MASS);
+    float *phi = getChannel(CHAN_LEVELSET);
+    const float restMass = density * mParams.cellSize * mParams.cellSize * mParams.cellSize;
+    const float scale = restMass > 0.0f ? 2.0f / restMass : 0.0f;
+    const int brickNodes = mGrid.getBrickNodes();
+    mPool->parallelFor(mGrid.getNumBricks(), BRICK_GRAIN, [&](int begin, int end, int thread) {
+        for (size_t n = (size_t)begin * brickNodes; n < (size_t)end * brickNodes; n++)
+            phi[n] = 1.0f - mass[n] * scale;
+    });
+}
+
+void MPMSolverCPU::G2P_GatherAPIC(int numPoints, float deltaTime) {
+    (this->*mTransfers.g2p[mGrid.getChannelFormat(CHAN_MOMENTUM)])(numPoints, deltaTime);
+}
+
+template <class S, int Format> void MPMSolverCPU::g2pAPIC(int numPoints, float deltaTime) {
+    const float dx = mParams.cellSize;
+    const float invDx = 1.0f / dx;
+    const float affineScale = S::Spline::affineScale() * invDx * invDx; // Inverse of D
+
+    const void *vel[3] = {mGrid.getChannelData(CHAN_MOMENTUM),
+                          mGrid.getChannelData(CHAN_MOMENTUM + 1),
+                          mGrid.getChannelData(CHAN_MOMENTUM + 2)};
+
+    float *pos[3], *pvel[3], *def[9], *aff[9];
+    getParticleStreams(pos, pvel, def, aff);
+
+    // Reuse the particle index of this step's P2G when there is one: particles of a bin read
+    // the same bricks
+    const int *order = mBinsValid ? mBinParticles.data() : 0;
+
+    // Velocity, affine matrix and deformation gradient from the grid, then advection, all in
+    // one pass over the particle streams. The velocity bounds are reduced on the way.
+    auto gatherParticle = [&](int p, const typename S::Batch &s, int lane, float *vmin,
+                              float *vmax) {
+        float xp[3], F[9];
+        for (int a = 0; a < 3; a++)
+            xp[a] = pos[a][p];
+        for (int k = 0; k < 9; k++)
+            F[k] = def[k][p];
+
+        size_t nodes[S::NODES];
+        getStencilNodes<S>(s, lane, nodes);
+
+        float v[3] = {0.0f, 0.0f, 0.0f};
+        float B[9] = {0.0f};
+        float gradV[9] = {0.0f};
+
+        for (int i = 0; i < S::SIZE; i++) {
+            for (int j = 0; j < S::SIZE; j++) {
+                for (int k = 0; k < S::SIZE_Z; k++) {
+                    float wx = s.w[0][i][lane], wy = s.w[1][j][lane], wz = s.w[2][k][lane];
+                    float w = wx * wy * wz;
+                    float gradW[3] = {s.dw[0][i][lane] * wy * wz * invDx,
+                                      wx * s.dw[1][j][lane] * wz * invDx,
+                                      wx * wy * s.dw[2][k][lane] * invDx};
+                    float dpos[3] = {(i - s.fx[0][lane]) * dx, (j - s.fx[1][lane]) * dx,
+                                     (k - s.fx[2][lane]) * dx};
+
+                    size_t n = nodes[(i * S::SIZE + j) * S::SIZE_Z + k];
+
+                    float vi[3] = {loadChannel<Format>(vel[0], n), loadChannel<Format>(vel[1], n),
+                                   loadChannel<Format>(vel[2], n)};
+                    for (int a = 0; a < 3; a++) {
+                        v[a] += w * vi[a];
+                        for (int b = 0; b < 3; b++) {
+                            B[a * 3 + b] += w * vi[a] * dpos[b];
+                            gradV[a * 3 + b] += vi[a] * gradW[b];
+                        }
+                    }
+                }
+            }
+        }
+
+        // Deformation gradient update F = (I + dt * grad v) F
+        float Fnew[9];
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                float sum = F[r * 3 + c];
+                for (int k = 0; k < 3; k++)
+                    sum += deltaTime * gradV[r * 3 + k] * F[k * 3 + c];
+                Fnew[r * 3 + c] = sum;
+            }
+        }
+
+        // Linear weights have no constant D, C is the velocity gradient instead
+        for (int k = 0; k < 9; k++) {
+            def[k][p] = Fnew[k];
+            aff[k][p] = S::Spline::affineScale() > 0.0f ? B[k] * affineScale : gradV[k];
+        }
+        for (int a = 0; a < 3; a++) {
+            pvel[a][p] = v[a];
+            pos[a][p] = xp[a] + deltaTime * v[a] * invDx; // m/s to grid units
+            vmin[a] = std::min(vmin[a], v[a]);
+            vmax[a] = std::max(vmax[a], v[a]);
+        }
+    };
+
+    // Streams read and written per particle, prefetched one batch ahead in index order
+    float *streams[24];
+    for (int k = 0; k < 3; k++) {
+        streams[k] = pos[k];
+        streams[3 + k] = pvel[k];
+    }
+    for (int k = 0; k < 9; k++) {
+        streams[6 + k] = def[k];
+        streams[15 + k] = aff[k];
+    }
+
+    const BSplineKernels &kernels = getBSplineKernels(mSimdLevel);
+    const int numThreads = mPool->getNumThreads();
+    std::vector<float> partialMin(numThreads * 3, FLT_MAX);
+    std::vector<float> partialMax(numThreads * 3, -FLT_MAX);
+
+    mPool->parallelFor(numPoints, PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        typename S::Batch s;
+        float *vmin = &partialMin[thread * 3];
+        float *vmax = &partialMax[thread * 3];
+        for (int first = begin; first < end; first += STENCIL_BATCH) {
+            int count = std::min(STENCIL_BATCH, end - first);
+            if (order) {
+                int next = std::min(STENCIL_BATCH, end - first - count);
+                for (int lane = 0; lane < next; lane++) {
+                    int p = order[first + count + lane];
+                    for (int k = 0; k < 24; k++)
+                        PREFETCH(&streams[k][p]);
+                }
+            }
+            computeStencils<S>(kernels, pos, order ? order + first : 0, first, count, s);
+            for (int lane = 0; lane < count; lane++)
+                gatherParticle(order ? order[first + lane] : first + lane, s, lane, vmin, vmax);
+        }
+    });
+    reduceVelocityBounds(numPoints, partialMin, partialMax);
+    mBinsValid = false; // Particles have moved
+}
+
+template <typename T> static inline size_t vectorBytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+size_t MPMSolverCPU::getMemoryUsage() const {
+    // Capacities, since the buffers keep them between steps
+    size_t bytes = vectorBytes(mParticleBins) + vectorBytes(mBinCounts) +
+                   vectorBytes(mBrickOffsets) + vectorBytes(mBrickParticles) +
+                   vectorBytes(mBinOffsets) + vectorBytes(mBinParticles) +
+                   vectorBytes(mBrickTouched) + vectorBytes(mActiveBricks);
+    for (int c = 0; c < 8; c++)
+        bytes += vectorBytes(mColorBricks[c]);
+    for (size_t t = 0; t < mThreadBricks.size(); t++) {
+        const ThreadBricks &local = mThreadBricks[t];
+        bytes += vectorBytes(local.slots) + vectorBytes(local.bricks) + vectorBytes(local.data);
+    }
+    return bytes;
+}
+
+void MPMSolverCPU::reduceVelocityBounds(int numPoints, const std::vector<float> &partialMin,
+                                        const std::vector<float> &partialMax) {
+    int numThreads = (int)partialMin.size() / 3;
+    for (int a = 0; a < 3; a++) {
+        mVelMin[a] = numPoints > 0 ? FLT_MAX : 0.0f;
+        mVelMax[a] = numPoints > 0 ? -FLT_MAX : 0.0f;
+        for (int t = 0; t < numThreads; t++) {
+            mVelMin[a] = std::min(mVelMin[a], partialMin[t * 3 + a]);
+            mVelMax[a] = std::max(mVelMax[a], partialMax[t * 3 + a]);
+        }
+    }
+}
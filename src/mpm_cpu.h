@@ -0,0 +1,236 @@
+#ifndef MPM_CPU_H
+#define MPM_CPU_H
+
+#include "bspline_kernels.h"
+#include "particle_set.h"
+#include "sparse_grid.h"
+#include "thread_pool.h"
+#include <memory>
+#include <vector>
+
+// Grid channels, numbered the same as the GVDB channels set up in Sample::init
+#define CHAN_LEVELSET 0
+#define CHAN_MOMENTUM 1 // x, y, z in channels 1-3 (velocity after grid update)
+#define CHAN_FORCE 4    // x, y, z in channels 4-6
+#define CHAN_MASS 7
+#define CHAN_COUNT 8
+
+#define LEVELSET_BACKGROUND 3.0f // Level set outside the bricks, the GVDB channel 0 default
+
+// Channels written by P2G (mass, momentum, force), kept per brick in thread-local buffers
+#define P2G_CHANNELS 7
+
+// B-spline orders of the transfers
+#define KERNEL_LINEAR 1
+#define KERNEL_QUADRATIC 2
+#define KERNEL_CUBIC 3
+
+// Stencil of a transfer specialization: SIZE nodes per axis, and a single node along z in 2D,
+// where every grid plane z = const holds an independent 2D simulation. Node (i, j, k) of the
+// stencil is entry (i * SIZE + j) * SIZE_Z + k of a node array.
+template <int Order, int Dim> struct TransferStencil {
+    typedef BSpline<Order> Spline;
+    typedef BSplineStencils<BSpline<Order>::SIZE> Batch;
+    static constexpr int SIZE = Spline::SIZE;
+    static constexpr int SIZE_Z = Dim == 3 ? SIZE : 1;
+    static constexpr int NODES = SIZE * SIZE * SIZE_Z;
+    static constexpr int size(int axis) { return axis == 2 ? SIZE_Z : SIZE; }
+};
+
+// Simulation constants. Keep these in sync with the GVDB MPM kernels when comparing backends.
+struct MPMParams {
+    float cellSize;      // Grid cell size in m (one grid unit is 1 cm)
+    float youngsModulus; // Pa
+    float poissonRatio;
+    float gravity[3];   // m/s^2
+    float groundHeight; // Ground plane height in grid units
+    float domainMin[3]; // Domain walls in grid units
+    float domainMax[3];
+};
+
+struct P2GArgs;
+
+// Multithreaded CPU implementation of the MPM step (APIC transfers, linear, quadratic or cubic
+// B-spline weights, Neo-Hookean elasticity). Works directly on the component arrays of a
+// ParticleSet and a SparseGrid with the same brick hierarchy as the GVDB grid.
+class MPMSolverCPU {
+  public:
+    MPMSolverCPU();
+
+    // Start the worker pool, must be called before the first step. 0 = all hardware threads.
+    void SetThreads(int numThreads);
+    int getNumThreads() { return mPool->getNumThreads(); }
+    ThreadPool *getPool() { return mPool.get(); }
+
+    // B-spline kernel instruction set (SIMD_*), clamped to what the CPU supports. Defaults to
+    // the best supported one.
+    void SetSimdLevel(int level);
+    int getSimdLevel() { return mSimdLevel; }
+
+    // B-spline order (KERNEL_*) and dimension (2 or 3) of the transfers. Every P2G and G2P
+    // variant is compiled for each combination with fixed stencil sizes; this selects which
+    // instantiations run. Defaults to quadratic 3D, the GVDB kernels.
+    void SetKernel(int order, int dim);
+    int getKernelOrder() { return mKernelOrder; }
+    int getDimension() { return mDimension; }
+
+    void SetPoints(ParticleSet *particles) {
+        mParticles = particles;
+        mBinsValid = false;
+    }
+
+    // Activate the bricks around the current particles and clear all channels. Returns false,
+    // with no active bricks, when the grid is out of memory; the step cannot run then.
+    bool RebuildTopology(int numPoints);
+    // Update the topology from the bricks particles moved into or out of since the last
+    // rebuild (see SparseGrid::SetIncremental)
+    void SetIncrementalTopology(bool incremental) { mGrid.SetIncremental(incremental); }
+    void ClearChannels();
+
+    // Storage format (CHANNEL_*) of the momentum or force channels, all three components.
+    // Mass and level set stay fp32. Transfers still accumulate in float: P2G sums each node in
+    // float and rounds once when it writes the brick, and the grid update and G2P convert on
+    // load, so reduced channels halve the grid memory and the bandwidth of clearing, updating
+    // and reading them. The atomic and coloured scatters add into the grid in place and run
+    // as P2G_ScatterReduceAPIC while a channel is reduced.
+    void SetChannelFormat(int chan, int format);
+    int getChannelFormat(int chan) { return mGrid.getChannelFormat(chan); }
+    // Rounding (ROUND_*) of the values written to reduced channels, ROUND_NEAREST by default.
+    // Stochastic bits come from the node index and a counter of write passes, not from the
+    // thread writing the node, so the gather stays deterministic for any thread count.
+    void SetRounding(int rounding) { mRounding = rounding; }
+    int getRounding() { return mRounding; }
+
+    void P2G_ScatterAPIC(int numPoints, float particleVolume);
+
+    // Scatter without atomics: particles are binned by the brick of their first stencil node
+    // and bricks are processed in 8 colour phases by brick coordinate parity (2x2x2), so
+    // bricks processed at the same time never write the same nodes. Every node sums its
+    // contributions in the same order for any thread count, so the result is deterministic.
+    void P2G_ColoredScatterAPIC(int numPoints, float particleVolume);
+
+    // Scatter without shared writes: every thread accumulates into its own copies of the bricks
+    // it touches, then each grid brick sums its thread copies pairwise (tree order) in parallel
+    void P2G_ScatterReduceAPIC(int numPoints, float particleVolume);
+
+    // Gather: every subcell of grid nodes pulls the contributions of the particles indexed in
+    // its neighbour subcells, so each node is written by one thread only. A subcell of size s
+    // reads 2x2x2 source subcells (27 cells for s = 1); smaller subcells read fewer particles
+    // outside their stencil reach, larger ones have fewer tasks. G2P reuses the same index.
+    void P2G_GatherAPIC(int numPoints, float particleVolume);
+
+    // Subcell edge in grid nodes for the particle index, a power of two up to the brick size
+    void SetSubcellSize(int size);
+
+    // Momentum to velocity, forces, gravity and collisions on the bricks that received particle
+    // contributions in the last P2G (getActiveBricks), so the cost follows the occupied volume
+    void MPM_GridUpdate(float deltaTime);
+
+    // Grid to particle transfer, F update and advection in a single pass per particle, which
+    // also reduces the new particle velocities into mVelMin / mVelMax for the CFL time step
+    void G2P_GatherAPIC(int numPoints, float deltaTime);
+
+    // Level set channel from the mass channel for rendering, the counterpart of GVDB's
+    // ConvertLinearMassChannelToTextureLevelSetChannel: 1 - 2 m / m0 with m0 the node mass at
+    // the given material density (kg/m^3), so negative inside and zero at half density
+    void ConvertMassToLevelSet(float density);
+
+    // Bytes held by the transfer buffers (thread brick copies, particle index, brick lists),
+    // which depend on the P2G variant; the grid reports its own with SparseGrid::getMemoryUsage
+    size_t getMemoryUsage() const;
+
+    SparseGrid &getGrid() { return mGrid; }
+    const std::vector<int> &getActiveBricks() { return mActiveBricks; }
+    float *getChannel(int chan) { return mGrid.getChannel(chan); }
+
+    MPMParams mParams;
+    float mVelMin[3]; // Particle velocity bounds after the last G2P (m/s)
+    float mVelMax[3];
+
+  private:
+    // Component arrays of the particle attributes used by the transfers
+    template <typename T> void getParticleStreams(T *pos[3], T *vel[3], T *def[9], T *aff[9]);
+
+    // Particle streams, grid channels and material constants used by the P2G variants
+    void getP2GArgs(float particleVolume, P2GArgs &args);
+
+    // Bricks a thread has scattered into in P2G_ScatterReduceAPIC. Slot s holds P2G_CHANNELS
+    // blocks of brick nodes: mass, momentum x, y, z, force x, y, z. The gather uses slot 0 of
+    // `data` as its float brick while channels are reduced.
+    struct ThreadBricks {
+        std::vector<int> slots;  // Local slot of each grid brick, -1 if not touched
+        std::vector<int> bricks; // Grid brick of each slot
+        std::vector<float> data;
+    };
+
+    // Channel index of each node of a particle stencil, in TransferStencil order. With `local`,
+    // indices into local->data instead, adding missing bricks to the thread's slots. With
+    // `touched` flags the grid bricks of the stencil (see markBrick).
+    template <class S>
+    void getStencilNodes(const typename S::Batch &s, int lane, size_t *nodes,
+                         ThreadBricks *local = 0, unsigned char *touched = 0);
+
+    // Run a P2G variant and collect the bricks it flagged in mBrickTouched into mActiveBricks
+    void runP2G(void (MPMSolverCPU::*transfer)(int, float), int numPoints, float particleVolume);
+
+    // Transfer variants specialized for stencil S, the public methods call the ones selected
+    // by SetKernel
+    template <class S> void scatterAPIC(int numPoints, float particleVolume);
+    template <class S> void coloredScatterAPIC(int numPoints, float particleVolume);
+    template <class S> void scatterReduceAPIC(int numPoints, float particleVolume);
+    template <class S> void gatherAPIC(int numPoints, float particleVolume);
+    template <class S, int Format> void g2pAPIC(int numPoints, float deltaTime);
+    template <class S> void setTransfers();
+
+    struct Transfers {
+        void (MPMSolverCPU::*scatter)(int numPoints, float particleVolume);
+        void (MPMSolverCPU::*coloredScatter)(int numPoints, float particleVolume);
+        void (MPMSolverCPU::*scatterReduce)(int numPoints, float particleVolume);
+        void (MPMSolverCPU::*gather)(int numPoints, float particleVolume);
+        // G2P per velocity channel format
+        void (MPMSolverCPU::*g2p[CHANNEL_FORMATS])(int numPoints, float deltaTime);
+    };
+
+    // Seed of the stochastic rounding bits of a pass writing reduced channels, add the channel
+    uint32_t nextRoundingSeed() { return mRoundingPass++ * GRID_CHANNELS; }
+    // Write `count` floats to channel `chan` of brick b from node `local` of the brick,
+    // converting to the channel format
+    void storeBrickNodes(int b, int chan, int local, int count, const float *src, uint32_t seed);
+
+    // Parallel counting sort of the particles by the subcell of their first stencil node, first
+    // by brick then by subcell inside each brick. Subcell c of brick b is bin
+    // b * subcells per brick + c; its particles are mBinParticles[mBinOffsets[bin] ..
+    // mBinOffsets[bin + 1]), and brick b's are the range starting at mBrickOffsets[b]. The
+    // index stays valid until the topology is rebuilt or the particles move.
+    void BinParticles(int numPoints);
+
+    // mVelMin / mVelMax from per-thread partial bounds, 3 floats per thread
+    void reduceVelocityBounds(int numPoints, const std::vector<float> &partialMin,
+                              const std::vector<float> &partialMax);
+
+    std::unique_ptr<ThreadPool> mPool;
+    int mSimdLevel;
+    int mKernelOrder;
+    int mDimension;
+    Transfers mTransfers;
+    int mRounding;
+    uint32_t mRoundingPass;
+
+    ParticleSet *mParticles;
+    SparseGrid mGrid;
+
+    int mSubcellLog2;
+    bool mBinsValid;
+    std::vector<int> mParticleBins; // Bin of the first stencil node of each particle
+    std::vector<int> mBinCounts;    // Particles per (block, brick), see BinParticles
+    std::vector<int> mBrickOffsets;
+    std::vector<int> mBrickParticles; // Particles sorted by brick only
+    std::vector<int> mBinOffsets;
+    std::vector<int> mBinParticles;
+    std::vector<int> mColorBricks[8]; // Bricks of each colour, colour = parity bits z y x
+    std::vector<ThreadBricks> mThreadBricks;
+    std::vector<unsigned char> mBrickTouched; // Per brick, set by the P2G variants
+    std::vector<int> mActiveBricks;
+};
+
+#endif
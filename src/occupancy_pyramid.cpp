@@ -0,0 +1,298 @@
+#include "occupancy_pyramid.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#define BRICK_GRAIN 16
+#define TOP_LEVEL_RES 4 // Stop adding levels once one fits in this many cells per axis
+
+// parallelFor on the pool, or on the calling thread without one
+static void runRange(ThreadPool *pool, int count, int grain, const ThreadPool::RangeFunc &fn) {
+    if (pool)
+        pool->parallelFor(count, grain, fn);
+    else if (count > 0)
+        fn(0, count, 0);
+}
+
+OccupancyPyramid::OccupancyPyramid() {
+    mPool = 0;
+    mChannel = 0;
+    mBackground = 0.0f;
+    mBrickLog2 = 3;
+    for (int a = 0; a < 3; a++) {
+        mBounds[0][a] = FLT_MAX;
+        mBounds[1][a] = -FLT_MAX;
+    }
+}
+
+void OccupancyPyramid::Build(SparseGrid &grid, int chan, float background) {
+    mChannel = grid.getChannel(chan);
+    mBackground = background;
+    mBrickLog2 = grid.getBrickLog2();
+    mLevels.clear();
+    mBoxBricks.clear();
+    for (int a = 0; a < 3; a++) {
+        mBounds[0][a] = FLT_MAX;
+        mBounds[1][a] = -FLT_MAX;
+    }
+    int numBricks = grid.getNumBricks();
+    if (numBricks == 0)
+        return;
+
+    // Level 0 box: the active bricks, one brick wider below for the cells that end in the
+    // first bricks
+    Level base;
+    base.cellSize = grid.getBrickRes();
+    base.branchLog2 = 0;
+    int boxMax[3];
+    for (int a = 0; a < 3; a++) {
+        base.boxMin[a] = grid.getBrickCoord(0)[a];
+        boxMax[a] = base.boxMin[a];
+    }
+    for (int b = 1; b < numBricks; b++) {
+        const int *c = grid.getBrickCoord(b);
+        for (int a = 0; a < 3; a++) {
+            base.boxMin[a] = std::min(base.boxMin[a], c[a]);
+            boxMax[a] = std::max(boxMax[a], c[a]);
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        base.boxMin[a]--;
+        base.boxRes[a] = boxMax[a] - base.boxMin[a] + 1;
+        mBounds[0][a] = (float)base.boxMin[a] * base.cellSize;
+        mBounds[1][a] = (float)(boxMax[a] + 1) * base.cellSize;
+    }
+    size_t baseEntries = (size_t)base.boxRes[0] * base.boxRes[1] * base.boxRes[2];
+    mBoxBricks.assign(baseEntries, -1);
+    for (int b = 0; b < numBricks; b++)
+        mBoxBricks[getIndex(base, grid.getBrickCoord(b))] = b;
+
+    // Range of every brick
+    int brickNodes = grid.getBrickNodes();
+    std::vector<float> brickMin(numBricks), brickMax(numBricks);
+    const float *data = mChannel;
+    runRange(mPool, numBricks, BRICK_GRAIN, [&](int begin, int end, int thread) {
+        for (int b = begin; b < end; b++) {
+            const float *v = data + (size_t)b * brickNodes;
+            float lo = v[0], hi = v[0];
+            for (int n = 1; n < brickNodes; n++) {
+                lo = std::min(lo, v[n]);
+                hi = std::max(hi, v[n]);
+            }
+            brickMin[b] = lo;
+            brickMax[b] = hi;
+        }
+    });
+
+    // Level 0 cells join their 2x2x2 bricks
+    base.lo.resize(baseEntries);
+    base.hi.resize(baseEntries);
+    int resX = base.boxRes[0], resY = base.boxRes[1], resZ = base.boxRes[2];
+    runRange(mPool, resZ, 1, [&](int begin, int end, int thread) {
+        for (int z = begin; z < end; z++) {
+            for (int y = 0; y < resY; y++) {
+                for (int x = 0; x < resX; x++) {
+                    float lo = FLT_MAX, hi = -FLT_MAX;
+                    for (int k = 0; k < 8; k++) {
+                        int cx = x + (k & 1), cy = y + ((k >> 1) & 1), cz = z + (k >> 2);
+                        int b = -1;
+                        if (cx < resX && cy < resY && cz < resZ)
+                            b = mBoxBricks[((size_t)cz * resY + cy) * resX + cx];
+                        lo = std::min(lo, b < 0 ? background : brickMin[b]);
+                        hi = std::max(hi, b < 0 ? background : brickMax[b]);
+                    }
+                    size_t i = ((size_t)z * resY + y) * resX + x;
+                    base.lo[i] = lo;
+                    base.hi[i] = hi;
+                }
+            }
+        }
+    });
+    mLevels.push_back(base);
+
+    // Upper levels with the branching of the grid levels
+    for (int l = 1; l < grid.getNumLevels(); l++) {
+        const Level &child = mLevels[l - 1];
+        if (std::max(child.boxRes[0], std::max(child.boxRes[1], child.boxRes[2])) <=
+            TOP_LEVEL_RES)
+            break;
+        Level level;
+        level.branchLog2 = grid.getLevelLog2(l);
+        level.cellSize = child.cellSize << level.branchLog2;
+        for (int a = 0; a < 3; a++) {
+            level.boxMin[a] = child.boxMin[a] >> level.branchLog2;
+            level.boxRes[a] =
+                ((child.boxMin[a] + child.boxRes[a] - 1) >> level.branchLog2) - level.boxMin[a] + 1;
+        }
+        size_t entries = (size_t)level.boxRes[0] * level.boxRes[1] * level.boxRes[2];
+        level.lo.resize(entries);
+        level.hi.resize(entries);
+        int branch = 1 << level.branchLog2;
+        runRange(mPool, level.boxRes[2], 1, [&](int begin, int end, int thread) {
+            for (int z = begin; z < end; z++) {
+                for (int y = 0; y < level.boxRes[1]; y++) {
+                    for (int x = 0; x < level.boxRes[0]; x++) {
+                        int cell[3] = {level.boxMin[0] + x, level.boxMin[1] + y,
+                                       level.boxMin[2] + z};
+                        float lo = FLT_MAX, hi = -FLT_MAX;
+                        int c[3];
+                        for (c[2] = cell[2] * branch; c[2] < (cell[2] + 1) * branch; c[2]++) {
+                            for (c[1] = cell[1] * branch; c[1] < (cell[1] + 1) * branch; c[1]++) {
+                                for (c[0] = cell[0] * branch; c[0] < (cell[0] + 1) * branch;
+                                     c[0]++) {
+                                    if (!inBox(child, c)) {
+                                        lo = std::min(lo, background);
+                                        hi = std::max(hi, background);
+                                        continue;
+                                    }
+                                    size_t i = getIndex(child, c);
+                                    lo = std::min(lo, child.lo[i]);
+                                    hi = std::max(hi, child.hi[i]);
+                                }
+                            }
+                        }
+                        size_t i = ((size_t)z * level.boxRes[1] + y) * level.boxRes[0] + x;
+                        level.lo[i] = lo;
+                        level.hi[i] = hi;
+                    }
+                }
+            }
+        });
+        mLevels.push_back(level);
+    }
+}
+
+void OccupancyPyramid::getRange(int level, const int cell[3], float &lo, float &hi) const {
+    if (level >= (int)mLevels.size() || !inBox(mLevels[level], cell)) {
+        lo = hi = mBackground;
+        return;
+    }
+    size_t i = getIndex(mLevels[level], cell);
+    lo = mLevels[level].lo[i];
+    hi = mLevels[level].hi[i];
+}
+
+float OccupancyPyramid::getValue(int x, int y, int z) const {
+    int c[3] = {x >> mBrickLog2, y >> mBrickLog2, z >> mBrickLog2};
+    int b = getBoxBrick(c);
+    if (b < 0)
+        return mBackground;
+    int mask = (1 << mBrickLog2) - 1;
+    int local = ((((z & mask) << mBrickLog2) | (y & mask)) << mBrickLog2) | (x & mask);
+    return mChannel[((size_t)b << (3 * mBrickLog2)) + local];
+}
+
+float OccupancyPyramid::Sample(const float p[3]) const {
+    float fx = std::floor(p[0]), fy = std::floor(p[1]), fz = std::floor(p[2]);
+    int x = (int)fx, y = (int)fy, z = (int)fz;
+    float tx = p[0] - fx, ty = p[1] - fy, tz = p[2] - fz;
+    float v[8];
+    int mask = (1 << mBrickLog2) - 1;
+    int b = -1;
+    if ((x & mask) != mask && (y & mask) != mask && (z & mask) != mask) {
+        int c[3] = {x >> mBrickLog2, y >> mBrickLog2, z >> mBrickLog2};
+        b = getBoxBrick(c);
+    }
+    if (b >= 0) {
+        // All corners in one brick
+        const float *n = mChannel + ((size_t)b << (3 * mBrickLog2)) +
+                         (((((z & mask) << mBrickLog2) | (y & mask)) << mBrickLog2) | (x & mask));
+        int dy = 1 << mBrickLog2, dz = 1 << (2 * mBrickLog2);
+        for (int k = 0; k < 8; k++)
+            v[k] = n[(k & 1) + ((k >> 1) & 1) * dy + (k >> 2) * dz];
+    } else {
+        for (int k = 0; k < 8; k++)
+            v[k] = getValue(x + (k & 1), y + ((k >> 1) & 1), z + (k >> 2));
+    }
+    float v00 = v[0] + (v[1] - v[0]) * tx, v10 = v[2] + (v[3] - v[2]) * tx;
+    float v01 = v[4] + (v[5] - v[4]) * tx, v11 = v[6] + (v[7] - v[6]) * tx;
+    float v0 = v00 + (v10 - v00) * ty, v1 = v01 + (v11 - v01) * ty;
+    return v0 + (v1 - v0) * tz;
+}
+
+void OccupancyPyramid::Traverse(const float o[3], const float d[3], float tMin, float tMax,
+                                float iso, const SpanFunc &fn) const {
+    if (mLevels.empty())
+        return;
+    Ray ray;
+    ray.iso = iso;
+    for (int a = 0; a < 3; a++) {
+        ray.o[a] = o[a];
+        ray.d[a] = d[a];
+        ray.invD[a] = d[a] == 0.0f ? 0.0f : 1.0f / d[a];
+        ray.step[a] = d[a] > 0.0f ? 1 : (d[a] < 0.0f ? -1 : 0);
+        // Outside the box every node reads the background
+        if (d[a] == 0.0f) {
+            if (o[a] < mBounds[0][a] || o[a] > mBounds[1][a])
+                return;
+            continue;
+        }
+        float t0 = (mBounds[0][a] - o[a]) * ray.invD[a];
+        float t1 = (mBounds[1][a] - o[a]) * ray.invD[a];
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+    }
+    if (tMin > tMax)
+        return;
+    traverseLevel((int)mLevels.size() - 1, 0, ray, tMin, tMax, fn);
+}
+
+bool OccupancyPyramid::traverseLevel(int level, const int *parent, const Ray &ray, float tMin,
+                                     float tMax, const SpanFunc &fn) const {
+    const Level &L = mLevels[level];
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        if (parent) {
+            int branchLog2 = mLevels[level + 1].branchLog2;
+            lo[a] = parent[a] << branchLog2;
+            hi[a] = lo[a] + (1 << branchLog2) - 1;
+        } else {
+            lo[a] = L.boxMin[a];
+            hi[a] = L.boxMin[a] + L.boxRes[a] - 1;
+        }
+    }
+
+    // Entry cell, clamped to the parent against rounding at its faces. Face crossings come from
+    // the cell itself rather than accumulated increments, so long rays stay exact.
+    float size = (float)L.cellSize;
+    int cell[3];
+    float tNext[3];
+    for (int a = 0; a < 3; a++) {
+        float p = ray.o[a] + tMin * ray.d[a];
+        cell[a] = std::min(std::max((int)std::floor(p / size), lo[a]), hi[a]);
+        tNext[a] = ray.step[a] == 0
+                       ? FLT_MAX
+                       : ((cell[a] + (ray.step[a] > 0)) * size - ray.o[a]) * ray.invD[a];
+    }
+
+    float t = tMin;
+    for (;;) {
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2)
+                                       : (tNext[1] < tNext[2] ? 1 : 2);
+        float tExit = std::min(tNext[axis], tMax);
+        if (tExit >= t && mayContain(level, cell, ray.iso)) {
+            if (level == 0) {
+                PyramidSpan span = {{cell[0], cell[1], cell[2]}, t, tExit};
+                if (!fn(span))
+                    return false;
+            } else if (!traverseLevel(level - 1, cell, ray, t, tExit, fn)) {
+                return false;
+            }
+        }
+        if (tNext[axis] >= tMax)
+            return true;
+        t = std::max(t, tNext[axis]);
+        cell[axis] += ray.step[axis];
+        if (cell[axis] < lo[axis] || cell[axis] > hi[axis])
+            return true;
+        tNext[axis] = ((cell[axis] + (ray.step[axis] > 0)) * size - ray.o[axis]) * ray.invD[axis];
+    }
+}
+
+size_t OccupancyPyramid::getMemoryUsage() const {
+    size_t bytes = mBoxBricks.capacity() * sizeof(int);
+    for (size_t l = 0; l < mLevels.size(); l++)
+        bytes += (mLevels[l].lo.capacity() + mLevels[l].hi.capacity()) * sizeof(float);
+    return bytes;
+}
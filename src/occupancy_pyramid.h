@@ -0,0 +1,110 @@
+#ifndef OCCUPANCY_PYRAMID_H
+#define OCCUPANCY_PYRAMID_H
+
+#include "sparse_grid.h"
+#include "thread_pool.h"
+#include <functional>
+#include <vector>
+
+// Segment of a ray inside a level 0 cell that may hold the iso surface
+struct PyramidSpan {
+    int cell[3]; // Brick coordinates of the cell
+    float tEnter;
+    float tExit;
+};
+
+// Min/max pyramid over one channel of a SparseGrid, the host counterpart of the GVDB node
+// hierarchy used for empty-space skipping. Level 0 cell (i, j, k) covers the trilinear cells
+// between nodes brickRes * (i, j, k) and brickRes * (i + 1, j + 1, k + 1), reading the bricks at
+// offsets 0 and 1 on each axis, and holds their value range. Every upper level cell covers a
+// block of cells of the level below, with the branching of the grid levels (8^3 for
+// Configure(3, 3, 3, 3, 3)), up to a level of a few cells. Nodes outside the active bricks read
+// the background value. Each level is a dense array over the box of the active bricks.
+class OccupancyPyramid {
+  public:
+    // Visitor of Traverse, returns false to stop
+    typedef std::function<bool(const PyramidSpan &)> SpanFunc;
+
+    OccupancyPyramid();
+
+    void SetPool(ThreadPool *pool) { mPool = pool; }
+
+    // Build the levels from channel `chan` of `grid`. The channel data is read in place, so
+    // rebuild after every change of the channel or the topology.
+    void Build(SparseGrid &grid, int chan, float background);
+
+    int getNumLevels() const { return (int)mLevels.size(); }
+    int getCellSize(int level) const { return mLevels[level].cellSize; } // Grid nodes
+
+    // Value range of a cell in level coordinates (grid position / cell size). Cells outside
+    // the pyramid hold only the background.
+    void getRange(int level, const int cell[3], float &lo, float &hi) const;
+
+    // Whether the trilinear level set inside a cell can cross `iso`
+    bool mayContain(int level, const int cell[3], float iso) const {
+        float lo, hi;
+        getRange(level, cell, lo, hi);
+        return lo < iso && hi >= iso;
+    }
+
+    // Channel value at a grid node and trilinear value at a position in grid units
+    float getValue(int x, int y, int z) const;
+    float Sample(const float p[3]) const;
+
+    // Hierarchical 3D-DDA along o + t d for t in [tMin, tMax]: visits the level 0 cells that
+    // may hold the iso surface front to back, descending only into upper level cells that may
+    // hold it. Cells without a crossing are never visited, so the cost follows the surface
+    // along the ray rather than the volume it crosses.
+    void Traverse(const float o[3], const float d[3], float tMin, float tMax, float iso,
+                  const SpanFunc &fn) const;
+
+    size_t getMemoryUsage() const;
+
+  private:
+    struct Level {
+        int cellSize;   // Grid nodes per cell edge
+        int branchLog2; // Log2 of the cells of the level below per cell edge
+        int boxMin[3];  // Cell coordinates of the first dense entry
+        int boxRes[3];
+        std::vector<float> lo, hi;
+    };
+
+    size_t getIndex(const Level &level, const int cell[3]) const {
+        return ((size_t)(cell[2] - level.boxMin[2]) * level.boxRes[1] +
+                (cell[1] - level.boxMin[1])) *
+                   level.boxRes[0] +
+               (cell[0] - level.boxMin[0]);
+    }
+    bool inBox(const Level &level, const int cell[3]) const {
+        return (unsigned)(cell[0] - level.boxMin[0]) < (unsigned)level.boxRes[0] &&
+               (unsigned)(cell[1] - level.boxMin[1]) < (unsigned)level.boxRes[1] &&
+               (unsigned)(cell[2] - level.boxMin[2]) < (unsigned)level.boxRes[2];
+    }
+    // Grid brick of the level 0 entry at brick coordinates c, -1 if not active or outside
+    int getBoxBrick(const int c[3]) const {
+        return mLevels.empty() || !inBox(mLevels[0], c) ? -1 : mBoxBricks[getIndex(mLevels[0], c)];
+    }
+
+    struct Ray {
+        float o[3];
+        float d[3];
+        float invD[3]; // 0 for axes the ray does not move along
+        int step[3];
+        float iso;
+    };
+
+    // DDA over the cells of `level` inside cell `parent` of the level above (the whole box on
+    // the top level) between tMin and tMax. False when the visitor stopped.
+    bool traverseLevel(int level, const int *parent, const Ray &ray, float tMin, float tMax,
+                       const SpanFunc &fn) const;
+
+    ThreadPool *mPool;
+    const float *mChannel;
+    float mBackground;
+    int mBrickLog2;
+    std::vector<int> mBoxBricks; // Grid brick per level 0 entry, -1 if not active
+    std::vector<Level> mLevels;  // Level 0 (brick cells) first
+    float mBounds[2][3];         // Box of the pyramid, grid units
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef PARTICLE_IO_H
+#define PARTICLE_IO_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Binary particle file (.p2g)
+//
+// Header, followed by 64-byte aligned blocks of float data, one block per attribute (SoA):
+//   positions               count * 3  (always present, grid units)
+//   velocities              count * 3  (PARTICLE_FILE_VELOCITY, m/s)
+//   deformation gradients   count * 9  (PARTICLE_FILE_DEFORMATION, row-major)
+//   affine states           count * 9  (PARTICLE_FILE_AFFINE, row-major)
+// Each block has the same layout as the matching particle DataPtr, so loading is a copy.
+// All values are little-endian.
+#define PARTICLE_FILE_MAGIC "P2GPART"
+#define PARTICLE_FILE_VERSION 1
+#define PARTICLE_FILE_ALIGNMENT 64
+
+#define PARTICLE_FILE_VELOCITY 1
+#define PARTICLE_FILE_DEFORMATION 2
+#define PARTICLE_FILE_AFFINE 4
+
+struct ParticleFileHeader {
+    char magic[8]; // PARTICLE_FILE_MAGIC, zero padded
+    uint32_t version;
+    uint32_t flags;       // PARTICLE_FILE_* payload bits
+    uint64_t count;       // Number of particles
+    float initialVolume;  // Initial volume of one particle (m^3)
+    float mass;           // Mass of one particle (kg)
+    uint64_t fileSize;    // Expected total size, to detect truncated files
+};
+
+// Read-only memory mapping of a binary particle file
+class ParticleFile {
+  public:
+    ParticleFile();
+    ~ParticleFile();
+
+    bool Open(const std::string &path);
+    void Close();
+
+    const ParticleFileHeader &getHeader() const { return *mHeader; }
+    int getCount() const { return (int)mHeader->count; }
+
+    // Attribute blocks, NULL if not present in the file
+    const float *getPositions() const { return getBlock(0); }
+    const float *getVelocities() const { return getBlock(1); }
+    const float *getDeformationGradients() const { return getBlock(2); }
+    const float *getAffineStates() const { return getBlock(3); }
+
+  private:
+    const float *getBlock(int block) const;
+
+    const char *mData;
+    uint64_t mSize;
+    const ParticleFileHeader *mHeader;
+#ifdef _WIN32
+    void *mFile;
+    void *mMapping;
+#else
+    int mFile;
+#endif
+};
+
+// True if the file starts with the binary particle file magic
+bool isParticleFile(const std::string &path);
+
+// Byte offset of each attribute block for a particle count and payload flags. Absent blocks
+// get offset 0. Returns the total file size.
+uint64_t getParticleFileLayout(uint64_t count, uint32_t flags, uint64_t offsets[4]);
+
+// Write a binary particle file. Velocities, deformationGradients and affineStates may be NULL.
+bool writeParticleFile(const std::string &path, uint64_t count, float initialVolume, float mass,
+                       const float *positions, const float *velocities,
+                       const float *deformationGradients, const float *affineStates);
+
+// Read the text .dat format written by generate_particles.py
+bool readParticleText(const std::string &path, std::vector<float> &positions,
+                      float &initialVolume, float &mass);
+
+#endif
@@ -0,0 +1,132 @@
+#include "particle_set.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+static const int attributeComponents[PARTICLE_ATTRIBUTES] = {3, 1, 3, 9, 9};
+
+static float *allocAligned(size_t bytes) {
+#ifdef _WIN32
+    return (float *)_aligned_malloc(bytes, PARTICLE_ALIGNMENT);
+#else
+    void *ptr = 0;
+    if (posix_memalign(&ptr, PARTICLE_ALIGNMENT, bytes) != 0)
+        return 0;
+    return (float *)ptr;
+#endif
+}
+
+static void freeAligned(float *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+ParticleSet::ParticleSet() {
+    mArena = 0;
+    mCount = 0;
+    mCapacity = 0;
+    mStride = 0;
+}
+
+ParticleSet::~ParticleSet() { Free(); }
+
+int ParticleSet::getNumComponents(int attribute) { return attributeComponents[attribute]; }
+
+bool ParticleSet::Reserve(int capacity) {
+    if (capacity <= mCapacity)
+        return true;
+
+    const size_t floatsPerLine = PARTICLE_ALIGNMENT / sizeof(float);
+    size_t stride = ((size_t)capacity + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+    float *arena = allocAligned((size_t)PARTICLE_STREAMS * stride * sizeof(float));
+    if (!arena)
+        return false;
+
+    if (mArena) {
+        for (int s = 0; s < PARTICLE_STREAMS; s++)
+            memcpy(arena + s * stride, mArena + s * mStride, (size_t)mCount * sizeof(float));
+        freeAligned(mArena);
+    }
+    mArena = arena;
+    mStride = stride;
+    mCapacity = capacity;
+    return true;
+}
+
+bool ParticleSet::Resize(int count) {
+    if (count > mCapacity) {
+        // Without room for the geometric growth, try the exact count
+        int capacity = count > mCapacity + mCapacity / 2 ? count : mCapacity + mCapacity / 2;
+        if (!Reserve(capacity) && !Reserve(count))
+            return false;
+    }
+    mCount = count;
+    return true;
+}
+
+void ParticleSet::Free() {
+    if (mArena)
+        freeAligned(mArena);
+    mArena = 0;
+    mCount = 0;
+    mCapacity = 0;
+    mStride = 0;
+}
+
+int ParticleSet::Compact(const unsigned char *keep) {
+    // Destination index of every kept particle, then an in-place forward copy per stream
+    int kept = 0;
+    int firstGap = mCount;
+    for (int i = 0; i < mCount; i++) {
+        if (!keep[i] && firstGap == mCount)
+            firstGap = i;
+        kept += keep[i] ? 1 : 0;
+    }
+    if (kept == mCount)
+        return mCount;
+
+    for (int s = 0; s < PARTICLE_STREAMS; s++) {
+        float *data = getStream(s);
+        int dst = firstGap;
+        for (int i = firstGap; i < mCount; i++) {
+            if (keep[i])
+                data[dst++] = data[i];
+        }
+    }
+    mCount = kept;
+    return mCount;
+}
+
+void ParticleSet::SetInterleaved(int attribute, const float *data) {
+    int components = attributeComponents[attribute];
+    for (int c = 0; c < components; c++) {
+        float *dst = getComponent(attribute, c);
+        for (int i = 0; i < mCount; i++)
+            dst[i] = data[(size_t)i * components + c];
+    }
+}
+
+void ParticleSet::GetInterleaved(int attribute, float *data) const {
+    int components = attributeComponents[attribute];
+    for (int c = 0; c < components; c++) {
+        const float *src = getComponent(attribute, c);
+        for (int i = 0; i < mCount; i++)
+            data[(size_t)i * components + c] = src[i];
+    }
+}
+
+void ParticleSet::Fill(int attribute, const float *value) {
+    int components = attributeComponents[attribute];
+    for (int c = 0; c < components; c++) {
+        float *dst = getComponent(attribute, c);
+        for (int i = 0; i < mCount; i++)
+            dst[i] = value[c];
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef PARTICLE_SET_H
+#define PARTICLE_SET_H
+
+#include <stddef.h>
+
+// Particle attributes
+#define PARTICLE_POSITION 0    // 3 components, grid units
+#define PARTICLE_MASS 1        // 1 component, kg
+#define PARTICLE_VELOCITY 2    // 3 components, m/s
+#define PARTICLE_DEFORMATION 3 // 9 components, row-major 3x3
+#define PARTICLE_AFFINE 4      // 9 components, row-major 3x3
+#define PARTICLE_ATTRIBUTES 5
+#define PARTICLE_STREAMS 25 // Total components over all attributes
+
+#define PARTICLE_ALIGNMENT 64 // Bytes, start of every component array
+
+// Structure-of-arrays particle storage: every component of every attribute (x, y, z, F00 ...)
+// is its own float array. All arrays live in a single aligned arena, each starting on a
+// PARTICLE_ALIGNMENT boundary and padded to the capacity, so loops over one component are
+// contiguous and vectorizable.
+class ParticleSet {
+  public:
+    ParticleSet();
+    ~ParticleSet();
+
+    int getCount() const { return mCount; }
+    int getCapacity() const { return mCapacity; }
+
+    // Change the particle count, keeping existing particles. Grows the arena geometrically, new
+    // particles are uninitialized. Both return false, leaving the set unchanged, when the arena
+    // cannot grow.
+    bool Resize(int count);
+    bool Reserve(int capacity);
+    void Free();
+
+    // Remove the particles with keep[i] == 0, preserving the order of the others. Returns the
+    // new count.
+    int Compact(const unsigned char *keep);
+
+    static int getNumComponents(int attribute);
+    float *getComponent(int attribute, int component) {
+        return getStream(getFirstStream(attribute) + component);
+    }
+    const float *getComponent(int attribute, int component) const {
+        return mArena + (size_t)(getFirstStream(attribute) + component) * mStride;
+    }
+    float *getStream(int stream) { return mArena + (size_t)stream * mStride; }
+
+    // Copy an attribute from / to interleaved storage (count * components floats, as in the
+    // particle DataPtrs and particle files)
+    void SetInterleaved(int attribute, const float *data);
+    void GetInterleaved(int attribute, float *data) const;
+
+    // Set an attribute of every particle to the same value (components floats)
+    void Fill(int attribute, const float *value);
+
+    size_t getMemoryUsage() const { return (size_t)PARTICLE_STREAMS * mStride * sizeof(float); }
+
+  private:
+    ParticleSet(const ParticleSet &);
+    ParticleSet &operator=(const ParticleSet &);
+
+    static int getFirstStream(int attribute) {
+        static const int firstStream[PARTICLE_ATTRIBUTES] = {0, 3, 4, 7, 16};
+        return firstStream[attribute];
+    }
+
+    float *mArena;
+    int mCount;
+    int mCapacity;
+    size_t mStride; // Floats between component arrays, capacity rounded up to the alignment
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include "particle_sort.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#define SORT_GRAIN 16384
+#define DISORDER_SAMPLES 4096
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define MORTON_AXIS_BITS 21
+
+// Spread the lower 21 bits of v so there are two zero bits between each
+static inline uint64_t spreadBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffull;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+// Morton code of the cell containing a position (grid units, clamped to the positive octant)
+static inline uint64_t cellMortonCode(const float *p) {
+    uint64_t code = 0;
+    for (int a = 0; a < 3; a++) {
+        float c = std::floor(p[a]);
+        uint64_t cell = c > 0.0f ? (uint64_t)c : 0;
+        if (cell >= (1ull << MORTON_AXIS_BITS))
+            cell = (1ull << MORTON_AXIS_BITS) - 1;
+        code |= spreadBits(cell) << a;
+    }
+    return code;
+}
+
+ParticleSorter::ParticleSorter() { mPool = 0; }
+
+void ParticleSorter::SetThreads(int numThreads) {
+    mOwnPool.reset(new ThreadPool(numThreads));
+    mPool = mOwnPool.get();
+}
+
+// Sampled fraction of adjacent particles whose cell code decreases. getPosition(i, p) fills p
+// with the position of particle i.
+template <typename PositionFunc>
+static float sampleDisorder(int numPoints, const PositionFunc &getPosition) {
+    if (numPoints < 2)
+        return 0.0f;
+    int samples = std::min(numPoints - 1, DISORDER_SAMPLES);
+    int descents = 0;
+    for (int s = 0; s < samples; s++) {
+        int i = (int)((int64_t)s * (numPoints - 1) / samples);
+        float p0[3], p1[3];
+        getPosition(i, p0);
+        getPosition(i + 1, p1);
+        descents += cellMortonCode(p1) < cellMortonCode(p0);
+    }
+    return (float)descents / samples;
+}
+
+float ParticleSorter::MeasureDisorder(const ParticleSet &particles) {
+    const float *pos[3] = {particles.getComponent(PARTICLE_POSITION, 0),
+                           particles.getComponent(PARTICLE_POSITION, 1),
+                           particles.getComponent(PARTICLE_POSITION, 2)};
+    return sampleDisorder(particles.getCount(), [&](int i, float *p) {
+        for (int a = 0; a < 3; a++)
+            p[a] = pos[a][i];
+    });
+}
+
+float ParticleSorter::MeasureDisorder(int numPoints, const float *positions) {
+    return sampleDisorder(numPoints, [&](int i, float *p) {
+        for (int a = 0; a < 3; a++)
+            p[a] = positions[(size_t)i * 3 + a];
+    });
+}
+
+void ParticleSorter::Sort(ParticleSet &particles) {
+    int numPoints = particles.getCount();
+    if (numPoints < 2)
+        return;
+
+    mKeys.resize(numPoints);
+    mOrder.resize(numPoints);
+    const float *pos[3] = {particles.getComponent(PARTICLE_POSITION, 0),
+                           particles.getComponent(PARTICLE_POSITION, 1),
+                           particles.getComponent(PARTICLE_POSITION, 2)};
+    std::vector<uint64_t> threadMax(mPool->getNumThreads(), 0);
+    mPool->parallelFor(numPoints, SORT_GRAIN, [&](int begin, int end, int thread) {
+        uint64_t maxKey = threadMax[thread];
+        for (int i = begin; i < end; i++) {
+            float p[3] = {pos[0][i], pos[1][i], pos[2][i]};
+            mKeys[i] = cellMortonCode(p);
+            mOrder[i] = i;
+            maxKey = std::max(maxKey, mKeys[i]);
+        }
+        threadMax[thread] = maxKey;
+    });
+    sortKeys(numPoints, *std::max_element(threadMax.begin(), threadMax.end()));
+
+    for (int s = 0; s < PARTICLE_STREAMS; s++)
+        permute(numPoints, particles.getStream(s), 1);
+}
+
+void ParticleSorter::Sort(int numPoints, float *positions, float *masses, float *velocities,
+                          float *deformationGradients, float *affineStates) {
+    if (numPoints < 2)
+        return;
+
+    mKeys.resize(numPoints);
+    mOrder.resize(numPoints);
+    std::vector<uint64_t> threadMax(mPool->getNumThreads(), 0);
+    mPool->parallelFor(numPoints, SORT_GRAIN, [&](int begin, int end, int thread) {
+        uint64_t maxKey = threadMax[thread];
+        for (int i = begin; i < end; i++) {
+            mKeys[i] = cellMortonCode(positions + (size_t)i * 3);
+            mOrder[i] = i;
+            maxKey = std::max(maxKey, mKeys[i]);
+        }
+        threadMax[thread] = maxKey;
+    });
+    sortKeys(numPoints, *std::max_element(threadMax.begin(), threadMax.end()));
+
+    permute(numPoints, positions, 3);
+    permute(numPoints, masses, 1);
+    permute(numPoints, velocities, 3);
+    permute(numPoints, deformationGradients, 9);
+    permute(numPoints, affineStates, 9);
+}
+
+void ParticleSorter::sortKeys(int numPoints, uint64_t maxKey) {
+    mKeysTmp.resize(numPoints);
+    mOrderTmp.resize(numPoints);
+
+    // Skip radix passes over digits that are zero in every key
+    int passes = 0;
+    while (passes * RADIX_BITS < 64 && (maxKey >> (passes * RADIX_BITS)) != 0)
+        passes++;
+
+    // Stable LSD radix sort. The particles are split into one contiguous block per thread: each
+    // block counts its digits, offsets are laid out digit-major then block, and every block
+    // scatters its particles in order, so the result does not depend on the thread schedule.
+    int numBlocks = mPool->getNumThreads();
+    int blockSize = (numPoints + numBlocks - 1) / numBlocks;
+    std::vector<int> offsets((size_t)numBlocks * RADIX_SIZE);
+    for (int pass = 0; pass < passes; pass++) {
+        int shift = pass * RADIX_BITS;
+        mPool->parallelFor(numBlocks, 1, [&](int begin, int end, int thread) {
+            for (int b = begin; b < end; b++) {
+                int *count = &offsets[(size_t)b * RADIX_SIZE];
+                memset(count, 0, RADIX_SIZE * sizeof(int));
+                int last = std::min(numPoints, (b + 1) * blockSize);
+                for (int i = b * blockSize; i < last; i++)
+                    count[(mKeys[i] >> shift) & (RADIX_SIZE - 1)]++;
+            }
+        });
+
+        int sum = 0;
+        for (int d = 0; d < RADIX_SIZE; d++) {
+            for (int b = 0; b < numBlocks; b++) {
+                int count = offsets[(size_t)b * RADIX_SIZE + d];
+                offsets[(size_t)b * RADIX_SIZE + d] = sum;
+                sum += count;
+            }
+        }
+
+        mPool->parallelFor(numBlocks, 1, [&](int begin, int end, int thread) {
+            for (int b = begin; b < end; b++) {
+                int *offset = &offsets[(size_t)b * RADIX_SIZE];
+                int last = std::min(numPoints, (b + 1) * blockSize);
+                for (int i = b * blockSize; i < last; i++) {
+                    int dst = offset[(mKeys[i] >> shift) & (RADIX_SIZE - 1)]++;
+                    mKeysTmp[dst] = mKeys[i];
+                    mOrderTmp[dst] = mOrder[i];
+                }
+            }
+        });
+        mKeys.swap(mKeysTmp);
+        mOrder.swap(mOrderTmp);
+    }
+}
+
+// Gather one particle array into sorted order through the scratch buffer
+void ParticleSorter::permute(int numPoints, float *data, int components) {
+    mScratch.resize((size_t)numPoints * components);
+    mPool->parallelFor(numPoints, SORT_GRAIN, [&](int begin, int end, int thread) {
+        for (int i = begin; i < end; i++) {
+            const float *src = data + (size_t)mOrder[i] * components;
+            float *dst = &mScratch[(size_t)i * components];
+            for (int c = 0; c < components; c++)
+                dst[c] = src[c];
+        }
+    });
+    mPool->parallelFor(numPoints, SORT_GRAIN, [&](int begin, int end, int thread) {
+        memcpy(data + (size_t)begin * components, &mScratch[(size_t)begin * components],
+               (size_t)(end - begin) * components * sizeof(float));
+    });
+}
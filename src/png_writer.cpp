@@ -0,0 +1,552 @@
+#include "png_writer.h"
+
+#include <algorithm>
+#include <queue>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BAND_BYTES (128 * 1024) // Filtered bytes per band, the unit of parallel work
+#define WINDOW_SIZE 32768
+#define HASH_BITS 15
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define BLOCK_SYMBOLS 32768 // LZ77 symbols per deflate block
+#define MATCH_FLAG 0x80000000u
+
+// Deflate length codes 257..285 and distance codes 0..29: base value and extra bits
+static const int lengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                   31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int distBase[30] = {1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                 33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const int distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                  6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const int codeLengthOrder[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                        11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+// Code lookups, built once: match length 3..258, distance 1..256 directly and larger
+// distances by (distance - 1) >> 7, as in zlib
+struct CodeTables {
+    unsigned char length[MAX_MATCH + 1];
+    unsigned char dist[512];
+    uint32_t crc[256];
+
+    CodeTables() {
+        for (int c = 0; c < 29; c++)
+            for (int len = lengthBase[c]; len <= MAX_MATCH && (c == 28 || len < lengthBase[c + 1]);
+                 len++)
+                length[len] = (unsigned char)c;
+        for (int c = 0; c < 30; c++) {
+            int last = c == 29 ? WINDOW_SIZE : distBase[c + 1] - 1;
+            for (int d = distBase[c]; d <= last; d++)
+                dist[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)] = (unsigned char)c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc[i] = c;
+        }
+    }
+};
+
+static const CodeTables &codeTables() {
+    static const CodeTables tables; // Thread-safe initialization
+    return tables;
+}
+
+static inline int lengthCode(int len) { return codeTables().length[len]; }
+
+static inline int distCode(int dist) {
+    return codeTables().dist[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+}
+
+// Deflate bit stream, least significant bit first
+struct BitWriter {
+    std::vector<unsigned char> &out;
+    uint64_t bits;
+    int count;
+
+    explicit BitWriter(std::vector<unsigned char> &o) : out(o), bits(0), count(0) {}
+    void put(uint32_t value, int n) {
+        bits |= (uint64_t)value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back((unsigned char)bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+    void align() {
+        if (count > 0)
+            out.push_back((unsigned char)bits);
+        bits = 0;
+        count = 0;
+    }
+};
+
+// Huffman code lengths limited to maxBits. Frequencies are halved until the tree fits.
+static void huffmanLengths(const uint32_t *freq, int n, int maxBits, unsigned char *lengths) {
+    std::vector<uint32_t> f(freq, freq + n);
+    std::fill(lengths, lengths + n, 0);
+    int used = 0, last = 0;
+    for (int i = 0; i < n; i++) {
+        if (f[i]) {
+            used++;
+            last = i;
+        }
+    }
+    if (used <= 1) {
+        // A single code still needs one bit; pair it with another symbol to keep it complete
+        lengths[last] = 1;
+        lengths[last == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    std::vector<int> parent(2 * n);
+    std::vector<int> depth(2 * n);
+    for (;;) {
+        typedef std::pair<uint64_t, int> Node;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node> > heap;
+        for (int i = 0; i < n; i++) {
+            if (f[i])
+                heap.push(Node(f[i], i));
+        }
+        int next = n;
+        while (heap.size() > 1) {
+            Node a = heap.top();
+            heap.pop();
+            Node b = heap.top();
+            heap.pop();
+            parent[a.second] = parent[b.second] = next;
+            heap.push(Node(a.first + b.first, next++));
+        }
+        // Parents are created after their children, so walk from the root down
+        int root = next - 1;
+        depth[root] = 0;
+        for (int node = root - 1; node >= 0; node--) {
+            if (node < n && !f[node])
+                continue;
+            depth[node] = depth[parent[node]] + 1;
+        }
+        int maxDepth = 0;
+        for (int i = 0; i < n; i++) {
+            if (f[i])
+                maxDepth = std::max(maxDepth, depth[i]);
+        }
+        if (maxDepth <= maxBits) {
+            for (int i = 0; i < n; i++)
+                lengths[i] = f[i] ? (unsigned char)depth[i] : 0;
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (f[i])
+                f[i] = (f[i] + 1) / 2;
+        }
+    }
+}
+
+// Canonical codes from code lengths, bit-reversed for the LSB-first stream
+static void huffmanCodes(const unsigned char *lengths, int n, uint32_t *codes) {
+    int count[16] = {0};
+    for (int i = 0; i < n; i++)
+        count[lengths[i]]++;
+    count[0] = 0;
+    uint32_t next[16];
+    uint32_t code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        int len = lengths[i];
+        if (!len)
+            continue;
+        uint32_t c = next[len]++, reversed = 0;
+        for (int b = 0; b < len; b++)
+            reversed |= ((c >> b) & 1) << (len - 1 - b);
+        codes[i] = reversed;
+    }
+}
+
+// One deflate block of LZ77 symbols, with dynamic or fixed codes, whichever is smaller
+static void writeBlock(BitWriter &bw, const std::vector<uint32_t> &symbols) {
+    uint32_t litFreq[286] = {0}, distFreq[30] = {0};
+    for (size_t i = 0; i < symbols.size(); i++) {
+        uint32_t s = symbols[i];
+        if (s & MATCH_FLAG) {
+            litFreq[257 + lengthCode((s >> 16) & 0x1ff)]++;
+            distFreq[distCode(s & 0xffff)]++;
+        } else {
+            litFreq[s]++;
+        }
+    }
+    litFreq[256] = 1;
+
+    unsigned char litLen[286], distLen[30];
+    huffmanLengths(litFreq, 286, 15, litLen);
+    huffmanLengths(distFreq, 30, 15, distLen);
+
+    int numLit = 286, numDist = 30;
+    while (numLit > 257 && !litLen[numLit - 1])
+        numLit--;
+    while (numDist > 1 && !distLen[numDist - 1])
+        numDist--;
+
+    // Run-length coded code lengths: 16 repeats the previous length 3-6 times, 17 and 18 are
+    // runs of 3-10 and 11-138 zeros
+    std::vector<unsigned char> all(litLen, litLen + numLit);
+    all.insert(all.end(), distLen, distLen + numDist);
+    std::vector<int> rle; // Symbol | extra << 8
+    for (size_t i = 0; i < all.size();) {
+        size_t run = 1;
+        while (i + run < all.size() && all[i + run] == all[i])
+            run++;
+        if (all[i] == 0 && run >= 3) {
+            run = std::min(run, (size_t)138);
+            rle.push_back(run >= 11 ? 18 | (int)(run - 11) << 8 : 17 | (int)(run - 3) << 8);
+        } else if (all[i] != 0 && run >= 4) {
+            run = std::min(run, (size_t)7);
+            rle.push_back(all[i]);
+            rle.push_back(16 | (int)(run - 4) << 8);
+        } else {
+            run = 1;
+            rle.push_back(all[i]);
+        }
+        i += run;
+    }
+    uint32_t clFreq[19] = {0};
+    for (size_t i = 0; i < rle.size(); i++)
+        clFreq[rle[i] & 0xff]++;
+    unsigned char clLen[19];
+    huffmanLengths(clFreq, 19, 7, clLen);
+    int numCl = 19;
+    while (numCl > 4 && !clLen[codeLengthOrder[numCl - 1]])
+        numCl--;
+
+    // Sizes in bits of both encodings
+    unsigned char fixedLit[288], fixedDist[30];
+    for (int i = 0; i < 288; i++)
+        fixedLit[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    std::fill(fixedDist, fixedDist + 30, 5);
+    uint64_t dynamicBits = 14 + 3 * numCl, fixedBits = 0;
+    for (size_t i = 0; i < rle.size(); i++) {
+        int sym = rle[i] & 0xff;
+        dynamicBits += clLen[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+    }
+    for (int i = 0; i < 286; i++) {
+        uint64_t extra = i > 256 ? lengthExtra[i - 257] : 0;
+        dynamicBits += litFreq[i] * (litLen[i] + extra);
+        fixedBits += litFreq[i] * (fixedLit[i] + extra);
+    }
+    for (int i = 0; i < 30; i++) {
+        dynamicBits += distFreq[i] * (distLen[i] + distExtra[i]);
+        fixedBits += distFreq[i] * (fixedDist[i] + distExtra[i]);
+    }
+
+    const unsigned char *lit = litLen, *dist = distLen;
+    if (fixedBits <= dynamicBits) {
+        lit = fixedLit;
+        dist = fixedDist;
+        bw.put(1 << 1, 3); // Not final, fixed codes
+    } else {
+        bw.put(2 << 1, 3); // Not final, dynamic codes
+        bw.put(numLit - 257, 5);
+        bw.put(numDist - 1, 5);
+        bw.put(numCl - 4, 4);
+        for (int i = 0; i < numCl; i++)
+            bw.put(clLen[codeLengthOrder[i]], 3);
+        uint32_t clCodes[19];
+        huffmanCodes(clLen, 19, clCodes);
+        for (size_t i = 0; i < rle.size(); i++) {
+            int sym = rle[i] & 0xff, extra = rle[i] >> 8;
+            bw.put(clCodes[sym], clLen[sym]);
+            if (sym >= 16)
+                bw.put(extra, sym == 16 ? 2 : sym == 17 ? 3 : 7);
+        }
+    }
+
+    uint32_t litCodes[288], distCodes[30];
+    huffmanCodes(lit, lit == fixedLit ? 288 : 286, litCodes);
+    huffmanCodes(dist, 30, distCodes);
+    for (size_t i = 0; i < symbols.size(); i++) {
+        uint32_t s = symbols[i];
+        if (s & MATCH_FLAG) {
+            int len = (s >> 16) & 0x1ff, d = s & 0xffff;
+            int lc = lengthCode(len), dc = distCode(d);
+            bw.put(litCodes[257 + lc], lit[257 + lc]);
+            bw.put(len - lengthBase[lc], lengthExtra[lc]);
+            bw.put(distCodes[dc], dist[dc]);
+            bw.put(d - distBase[dc], distExtra[dc]);
+        } else {
+            bw.put(litCodes[s], lit[s]);
+        }
+    }
+    bw.put(litCodes[256], lit[256]);
+}
+
+static inline uint32_t hash3(const unsigned char *p) {
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Deflate data[begin, end) as non-final blocks closed by an empty stored block (byte aligned,
+// final for the last band). Matches may reach back into the 32 KB before begin.
+static void deflateBand(const unsigned char *data, size_t begin, size_t end, bool last, int level,
+                        std::vector<unsigned char> &out) {
+    const int maxChain = level == PNG_LEVEL_FAST ? 4 : 64;
+    const int niceLength = level == PNG_LEVEL_FAST ? 16 : 128;
+
+    size_t start = begin > WINDOW_SIZE ? begin - WINDOW_SIZE : 0;
+    const unsigned char *src = data + start;
+    const int n = (int)(end - start);
+    std::vector<int> head(1 << HASH_BITS, -1);
+    std::vector<int> prev(n);
+    auto insert = [&](int i) {
+        if (i + MIN_MATCH <= n) {
+            uint32_t h = hash3(src + i);
+            prev[i] = head[h];
+            head[h] = i;
+        }
+    };
+    int pos = (int)(begin - start);
+    for (int i = 0; i < pos; i++)
+        insert(i);
+
+    BitWriter bw(out);
+    std::vector<uint32_t> symbols;
+    symbols.reserve(BLOCK_SYMBOLS);
+    while (pos < n) {
+        int best = 0, bestDist = 0;
+        int maxLen = std::min(MAX_MATCH, n - pos);
+        if (maxLen >= MIN_MATCH) {
+            int chain = maxChain;
+            for (int cand = head[hash3(src + pos)]; cand >= 0 && pos - cand <= WINDOW_SIZE &&
+                                                    chain-- > 0;
+                 cand = prev[cand]) {
+                if (src[cand + best] != src[pos + best])
+                    continue;
+                int len = 0;
+                while (len < maxLen && src[cand + len] == src[pos + len])
+                    len++;
+                if (len > best) {
+                    best = len;
+                    bestDist = pos - cand;
+                    if (len >= niceLength || len == maxLen)
+                        break;
+                }
+            }
+        }
+        if (best >= MIN_MATCH) {
+            symbols.push_back(MATCH_FLAG | (uint32_t)best << 16 | (uint32_t)bestDist);
+            for (int i = 0; i < best; i++)
+                insert(pos + i);
+            pos += best;
+        } else {
+            symbols.push_back(src[pos]);
+            insert(pos);
+            pos++;
+        }
+        if (symbols.size() == BLOCK_SYMBOLS) {
+            writeBlock(bw, symbols);
+            symbols.clear();
+        }
+    }
+    if (!symbols.empty())
+        writeBlock(bw, symbols);
+
+    // Empty stored block: byte aligned end, like a zlib sync flush
+    bw.put(last ? 1 : 0, 3);
+    bw.align();
+    out.push_back(0x00);
+    out.push_back(0x00);
+    out.push_back(0xff);
+    out.push_back(0xff);
+}
+
+static uint32_t adler32(const unsigned char *data, size_t len) {
+    uint32_t a = 1, b = 0;
+    while (len > 0) {
+        size_t chunk = std::min(len, (size_t)5552); // Largest run without 32-bit overflow
+        for (size_t i = 0; i < chunk; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += chunk;
+        len -= chunk;
+    }
+    return b << 16 | a;
+}
+
+// Adler-32 of the concatenation of two blocks from their checksums and the second length
+static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    const uint64_t base = 65521;
+    uint64_t rem = len2 % base;
+    uint64_t a1 = adler1 & 0xffff, b1 = adler1 >> 16;
+    uint64_t a2 = adler2 & 0xffff, b2 = adler2 >> 16;
+    uint64_t a = (a1 + a2 + base - 1) % base;
+    uint64_t b = (rem * a1 + b1 + b2 + base - rem) % base;
+    return (uint32_t)(b << 16 | a);
+}
+
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t len) {
+    const uint32_t *table = codeTables().crc;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void putBigEndian(std::vector<unsigned char> &out, uint32_t v) {
+    out.push_back((unsigned char)(v >> 24));
+    out.push_back((unsigned char)(v >> 16));
+    out.push_back((unsigned char)(v >> 8));
+    out.push_back((unsigned char)v);
+}
+
+static void writeChunk(std::vector<unsigned char> &out, const char *type,
+                       const unsigned char *data, size_t len) {
+    putBigEndian(out, (uint32_t)len);
+    size_t typePos = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + len);
+    putBigEndian(out, crc32(0, &out[typePos], len + 4));
+}
+
+static inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filter one row into out (filter type byte first), above = 0 for the first row. The fast
+// level always uses Sub, the default level picks the filter with the smallest sum of absolute
+// values.
+static void filterRow(const unsigned char *row, const unsigned char *above, int bytes, int bpp,
+                      int level, unsigned char *out) {
+    auto apply = [&](int type, unsigned char *dst) {
+        for (int i = 0; i < bytes; i++) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = above ? above[i] : 0;
+            int c = above && i >= bpp ? above[i - bpp] : 0;
+            int pred = 0;
+            switch (type) {
+            case 1:
+                pred = a;
+                break;
+            case 2:
+                pred = b;
+                break;
+            case 3:
+                pred = (a + b) / 2;
+                break;
+            case 4:
+                pred = paeth(a, b, c);
+                break;
+            }
+            dst[i] = (unsigned char)(row[i] - pred);
+        }
+    };
+
+    if (level == PNG_LEVEL_FAST) {
+        out[0] = 1;
+        apply(1, out + 1);
+        return;
+    }
+    std::vector<unsigned char> trial(bytes);
+    uint64_t bestSum = ~0ull;
+    for (int type = 0; type < 5; type++) {
+        apply(type, trial.data());
+        uint64_t sum = 0;
+        for (int i = 0; i < bytes; i++)
+            sum += trial[i] < 128 ? trial[i] : 256 - trial[i];
+        if (sum < bestSum) {
+            bestSum = sum;
+            out[0] = (unsigned char)type;
+            std::copy(trial.begin(), trial.end(), out + 1);
+        }
+    }
+}
+
+void EncodePNG(std::vector<unsigned char> &out, const unsigned char *img, int w, int h,
+               int channels, int level, ThreadPool *pool) {
+    const size_t rowBytes = (size_t)w * channels;
+    const size_t stride = rowBytes + 1;
+    const int bandRows = (int)std::max((size_t)1, BAND_BYTES / stride);
+    const int numBands = (h + bandRows - 1) / bandRows;
+
+    // Filter and deflate every band. A band matches into the filtered rows before it, so all
+    // rows are filtered first.
+    std::vector<unsigned char> filtered(stride * h);
+    std::vector<std::vector<unsigned char> > streams(numBands);
+    std::vector<uint32_t> adlers(numBands);
+    auto run = [&](int count, const ThreadPool::RangeFunc &fn) {
+        if (pool)
+            pool->parallelFor(count, 1, fn);
+        else
+            fn(0, count, 0);
+    };
+    run(numBands, [&](int begin, int end, int thread) {
+        for (int band = begin; band < end; band++) {
+            int last = std::min(h, (band + 1) * bandRows);
+            for (int y = band * bandRows; y < last; y++)
+                filterRow(img + y * rowBytes, y > 0 ? img + (y - 1) * rowBytes : 0,
+                          (int)rowBytes, channels, level, &filtered[y * stride]);
+        }
+    });
+    run(numBands, [&](int begin, int end, int thread) {
+        for (int band = begin; band < end; band++) {
+            size_t first = (size_t)band * bandRows * stride;
+            size_t last = (size_t)std::min(h, (band + 1) * bandRows) * stride;
+            deflateBand(filtered.data(), first, last, band == numBands - 1, level,
+                        streams[band]);
+            adlers[band] = adler32(&filtered[first], last - first);
+        }
+    });
+
+    std::vector<unsigned char> zlib;
+    zlib.push_back(0x78);
+    zlib.push_back(level == PNG_LEVEL_FAST ? 0x01 : 0x9c);
+    uint32_t adler = 1;
+    for (int band = 0; band < numBands; band++) {
+        zlib.insert(zlib.end(), streams[band].begin(), streams[band].end());
+        size_t len = (size_t)(std::min(h, (band + 1) * bandRows) - band * bandRows) * stride;
+        adler = adler32Combine(adler, adlers[band], len);
+    }
+    if (numBands == 0) {
+        zlib.push_back(0x03); // Empty final fixed block
+        zlib.push_back(0x00);
+    }
+    putBigEndian(zlib, adler);
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a};
+    unsigned char header[13];
+    for (int i = 0; i < 4; i++) {
+        header[i] = (unsigned char)(w >> (24 - 8 * i));
+        header[4 + i] = (unsigned char)(h >> (24 - 8 * i));
+    }
+    header[8] = 8;                      // Bit depth
+    header[9] = channels == 4 ? 6 : 2;  // RGBA or RGB
+    header[10] = header[11] = header[12] = 0;
+
+    out.assign(signature, signature + 8);
+    writeChunk(out, "IHDR", header, 13);
+    writeChunk(out, "IDAT", zlib.data(), zlib.size());
+    writeChunk(out, "IEND", 0, 0);
+}
+
+bool SavePNG(const char *fname, const unsigned char *img, int w, int h, int channels, int level,
+             ThreadPool *pool) {
+    std::vector<unsigned char> png;
+    EncodePNG(png, img, w, h, channels, level, pool);
+    FILE *fp = fopen(fname, "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(png.data(), 1, png.size(), fp) == png.size();
+    return fclose(fp) == 0 && ok;
+}
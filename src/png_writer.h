@@ -0,0 +1,22 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include "thread_pool.h"
+#include <vector>
+
+// Compression levels of EncodePNG
+#define PNG_LEVEL_FAST 1    // Sub filter, short match search
+#define PNG_LEVEL_DEFAULT 2 // Per-row filter choice, longer match search
+
+// 8-bit RGB (channels = 3) or RGBA (channels = 4) image to PNG. Rows are split into bands that
+// are filtered and deflated in parallel on `pool` (serially without one). Every band ends on a
+// byte boundary with an empty stored block and may match into the 32 KB before it, so the band
+// streams join into a single zlib stream, as in pigz.
+void EncodePNG(std::vector<unsigned char> &out, const unsigned char *img, int w, int h,
+               int channels, int level, ThreadPool *pool = 0);
+
+// EncodePNG to a file, false if the file cannot be written
+bool SavePNG(const char *fname, const unsigned char *img, int w, int h, int channels, int level,
+             ThreadPool *pool = 0);
+
+#endif
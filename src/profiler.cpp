@@ -0,0 +1,231 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+// Small sequential thread IDs for the trace, in order of first use
+static int getThreadIndex() {
+    static std::atomic<int> nextIndex(0);
+    thread_local int index = nextIndex++;
+    return index;
+}
+
+Profiler::Profiler() {
+    mBackend = PROFILE_CPU;
+    mFrame = 0;
+    mIteration = 0;
+    mNumParticles = 0;
+    mTrace = 0;
+    mTraceEvents = 0;
+    mOriginEvent = -1;
+}
+
+Profiler::~Profiler() {
+    CloseTrace();
+    for (size_t i = 0; i < mEvents.size(); i++)
+        cudaEventDestroy(mEvents[i]);
+}
+
+void Profiler::SetBackend(int backend) {
+    Reset();
+    mBackend = backend;
+}
+
+int Profiler::findPhase(const char *name) {
+    for (size_t i = 0; i < mPhases.size(); i++) {
+        if (mPhases[i].name.compare(name) == 0)
+            return (int)i;
+    }
+    Phase phase;
+    phase.name = name;
+    phase.lastTotal = 0.0;
+    mPhases.push_back(phase);
+    return (int)mPhases.size() - 1;
+}
+
+int Profiler::acquireEvent() {
+    if (!mFreeEvents.empty()) {
+        int e = mFreeEvents.back();
+        mFreeEvents.pop_back();
+        return e;
+    }
+    cudaEvent_t event;
+    cudaEventCreate(&event);
+    mEvents.push_back(event);
+    return (int)mEvents.size() - 1;
+}
+
+void Profiler::SetContext(int frame, int iteration, int numParticles) {
+    mFrame = frame;
+    mIteration = iteration;
+    mNumParticles = numParticles;
+}
+
+void Profiler::Push(const char *name) {
+    Timer timer;
+    timer.phase = findPhase(name);
+    timer.thread = getThreadIndex();
+    timer.frame = mFrame;
+    timer.iteration = mIteration;
+    timer.numParticles = mNumParticles;
+    timer.startEvent = -1;
+    timer.endEvent = -1;
+    if (mBackend == PROFILE_CUDA) {
+        timer.startEvent = acquireEvent();
+        cudaEventRecord(mEvents[timer.startEvent]);
+    } else {
+        timer.cpuStart = std::chrono::steady_clock::now();
+    }
+    mStack.push_back((int)mPending.size());
+    mPending.push_back(timer);
+}
+
+void Profiler::Pop() {
+    if (mStack.empty())
+        return;
+    Timer &timer = mPending[mStack.back()];
+    mStack.pop_back();
+    if (mBackend == PROFILE_CUDA) {
+        timer.endEvent = acquireEvent();
+        cudaEventRecord(mEvents[timer.endEvent]);
+    } else {
+        timer.cpuEnd = std::chrono::steady_clock::now();
+    }
+}
+
+void Profiler::Resolve() {
+    if (!mStack.empty())
+        return;
+
+    for (size_t i = 0; i < mPhases.size(); i++)
+        mPhases[i].lastTotal = 0.0;
+    if (mPending.empty())
+        return;
+
+    // Events are recorded in order on one stream, so waiting for the last one is enough
+    if (mBackend == PROFILE_CUDA)
+        cudaEventSynchronize(mEvents[mPending.back().endEvent]);
+
+    for (size_t i = 0; i < mPending.size(); i++) {
+        Timer &timer = mPending[i];
+        float duration = 0.0; // In milliseconds
+        double start = 0.0;   // Since trace origin, in milliseconds
+        if (mBackend == PROFILE_CUDA) {
+            cudaEventElapsedTime(&duration, mEvents[timer.startEvent], mEvents[timer.endEvent]);
+            if (mTrace) {
+                float sinceOrigin = 0.0;
+                cudaEventElapsedTime(&sinceOrigin, mEvents[mOriginEvent],
+                                     mEvents[timer.startEvent]);
+                start = sinceOrigin;
+            }
+            mFreeEvents.push_back(timer.startEvent);
+            mFreeEvents.push_back(timer.endEvent);
+        } else {
+            std::chrono::duration<float, std::milli> elapsed = timer.cpuEnd - timer.cpuStart;
+            duration = elapsed.count();
+            std::chrono::duration<double, std::milli> sinceOrigin = timer.cpuStart - mOrigin;
+            start = sinceOrigin.count();
+        }
+        mPhases[timer.phase].samples.push_back(duration);
+        mPhases[timer.phase].lastTotal += duration;
+        if (mTrace)
+            writeTraceEvent(timer, start, duration);
+    }
+    mPending.clear();
+}
+
+float Profiler::getLastTotal(const char *name) {
+    for (size_t i = 0; i < mPhases.size(); i++) {
+        if (mPhases[i].name.compare(name) == 0)
+            return mPhases[i].lastTotal;
+    }
+    return 0.0;
+}
+
+const std::vector<float> *Profiler::getSamples(const char *name) {
+    for (size_t i = 0; i < mPhases.size(); i++) {
+        if (mPhases[i].name.compare(name) == 0)
+            return &mPhases[i].samples;
+    }
+    return 0;
+}
+
+static float percentile(std::vector<float> &sorted, float p) {
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5f);
+    return sorted[i];
+}
+
+void Profiler::Report() {
+    Resolve();
+
+    printf("\nPhase timings (ms)\n");
+    printf("  %-20s %8s %12s %10s %10s %10s %10s %10s\n", "phase", "count", "total", "min",
+           "mean", "p50", "p99", "max");
+    for (size_t i = 0; i < mPhases.size(); i++) {
+        std::vector<float> sorted = mPhases[i].samples;
+        if (sorted.empty())
+            continue;
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0.0;
+        for (size_t k = 0; k < sorted.size(); k++)
+            total += sorted[k];
+        printf("  %-20s %8d %12.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", mPhases[i].name.c_str(),
+               (int)sorted.size(), total, sorted.front(), total / sorted.size(),
+               percentile(sorted, 0.5f), percentile(sorted, 0.99f), sorted.back());
+    }
+}
+
+void Profiler::Reset() {
+    for (size_t i = 0; i < mPending.size(); i++) {
+        if (mPending[i].startEvent >= 0)
+            mFreeEvents.push_back(mPending[i].startEvent);
+        if (mPending[i].endEvent >= 0)
+            mFreeEvents.push_back(mPending[i].endEvent);
+    }
+    mPending.clear();
+    mStack.clear();
+    mPhases.clear();
+}
+
+bool Profiler::OpenTrace(const std::string &path) {
+    CloseTrace();
+    mTrace = fopen(path.c_str(), "w");
+    if (!mTrace) {
+        printf("Error: Cannot write trace file %s\n", path.c_str());
+        return false;
+    }
+    fprintf(mTrace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    mTraceEvents = 0;
+
+    // Timestamps of pending scopes would predate the origin, drop them
+    Reset();
+    mOrigin = std::chrono::steady_clock::now();
+    if (mBackend == PROFILE_CUDA) {
+        if (mOriginEvent < 0)
+            mOriginEvent = acquireEvent();
+        cudaEventRecord(mEvents[mOriginEvent]);
+    }
+    return true;
+}
+
+void Profiler::CloseTrace() {
+    if (!mTrace)
+        return;
+    Resolve();
+    fprintf(mTrace, "\n]}\n");
+    fclose(mTrace);
+    mTrace = 0;
+}
+
+void Profiler::writeTraceEvent(const Timer &timer, double start, float duration) {
+    // Trace event timestamps and durations are in microseconds
+    fprintf(mTrace,
+            "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":0,\"tid\":%d,\"args\":{\"frame\":%d,\"iteration\":%d,\"particles\":%d}}",
+            mTraceEvents ? ",\n" : "", mPhases[timer.phase].name.c_str(),
+            mBackend == PROFILE_CUDA ? "cuda" : "cpu", start * 1000.0, duration * 1000.0,
+            timer.thread, timer.frame, timer.iteration, timer.numParticles);
+    mTraceEvents++;
+}
@@ -0,0 +1,88 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "cuda_runtime_api.h"
+#include <chrono>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Timer backends
+#define PROFILE_CPU 0  // steady_clock, for the CPU backend
+#define PROFILE_CUDA 1 // CUDA events on the default stream
+
+// Named phase timers with deferred resolution. Push/Pop only record a timestamp (CUDA events
+// come from a pool and are reused), durations are collected in Resolve with at most one
+// synchronization. Every resolved scope becomes one sample of its phase; Report prints
+// statistics over all samples of the run.
+//
+// With OpenTrace, every resolved scope is also written as a Chrome trace event ("X" phase,
+// loadable in chrome://tracing or Perfetto) carrying the thread, frame, iteration and particle
+// count that were current when the scope was pushed.
+class Profiler {
+  public:
+    Profiler();
+    ~Profiler();
+
+    void SetBackend(int backend);
+    int getBackend() { return mBackend; }
+
+    void Push(const char *name);
+    void Pop();
+
+    // Frame, iteration and particle count attached to scopes pushed from now on
+    void SetContext(int frame, int iteration, int numParticles);
+
+    bool OpenTrace(const std::string &path);
+    void CloseTrace();
+
+    // Collect all closed scopes. Must be called outside of any open scope.
+    void Resolve();
+
+    // Sum of the samples of a phase collected by the last Resolve (ms)
+    float getLastTotal(const char *name);
+
+    // All samples of a phase in the order they were recorded, NULL if the phase never ran
+    const std::vector<float> *getSamples(const char *name);
+
+    void Report();
+    void Reset();
+
+  private:
+    struct Phase {
+        std::string name;
+        std::vector<float> samples; // ms
+        float lastTotal;
+    };
+    struct Timer {
+        int phase;
+        int thread;
+        int frame;
+        int iteration;
+        int numParticles;
+        int startEvent; // Index into mEvents (CUDA backend)
+        int endEvent;
+        std::chrono::steady_clock::time_point cpuStart; // CPU backend
+        std::chrono::steady_clock::time_point cpuEnd;
+    };
+
+    int findPhase(const char *name);
+    int acquireEvent();
+    void writeTraceEvent(const Timer &timer, double start, float duration);
+
+    int mBackend;
+    std::vector<Phase> mPhases;
+    std::vector<Timer> mPending; // Scopes recorded since the last Resolve
+    std::vector<int> mStack;     // Indices into mPending of open scopes
+    std::vector<cudaEvent_t> mEvents;
+    std::vector<int> mFreeEvents;
+
+    int mFrame, mIteration, mNumParticles;
+
+    FILE *mTrace;
+    int mTraceEvents;
+    int mOriginEvent; // Trace time zero (CUDA backend)
+    std::chrono::steady_clock::time_point mOrigin;
+};
+
+#endif
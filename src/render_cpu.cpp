@@ -0,0 +1,254 @@
+#include "render_cpu.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#define TILE_SIZE 16     // Pixels per tile edge, one parallelFor item per tile
+#define BISECTION_STEPS 8
+#define NO_HIT_LENGTH 1.0e10f
+
+// Ray depths of optix_trace_surface.cu
+#define REFLECT_DEPTH 1
+#define REFRACT_DEPTH 2
+#define SHADOW_DEPTH 1
+
+static inline float dot3(const float a[3], const float b[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline void normalize3(float v[3]) {
+    float len = std::sqrt(dot3(v, v));
+    if (len > 0.0f) {
+        v[0] /= len;
+        v[1] /= len;
+        v[2] /= len;
+    }
+}
+
+// optix::refract: direction r through a surface with normal n (pointing outside) from incident
+// direction i, entering or leaving a medium of index ior. False on total internal reflection.
+static bool refract(float r[3], const float i[3], const float n[3], float ior) {
+    float nn[3] = {n[0], n[1], n[2]};
+    float negNdotV = dot3(i, n);
+    float eta = 1.0f / ior;
+    if (negNdotV > 0.0f) {
+        eta = ior;
+        for (int a = 0; a < 3; a++)
+            nn[a] = -n[a];
+        negNdotV = -negNdotV;
+    }
+    float k = 1.0f - eta * eta * (1.0f - negNdotV * negNdotV);
+    if (k < 0.0f)
+        return false;
+    for (int a = 0; a < 3; a++)
+        r[a] = eta * i[a] - (eta * negNdotV + std::sqrt(k)) * nn[a];
+    normalize3(r);
+    return true;
+}
+
+// parallelFor on the pool, or on the calling thread without one
+static void runRange(ThreadPool *pool, int count, int grain, const ThreadPool::RangeFunc &fn) {
+    if (pool)
+        pool->parallelFor(count, grain, fn);
+    else if (count > 0)
+        fn(0, count, 0);
+}
+
+LevelSetRendererCPU::LevelSetRendererCPU() {
+    mPool = 0;
+    for (int a = 0; a < 3; a++) {
+        mCamera.pos[a] = 0.0f;
+        mCamera.corner[a] = a == 2 ? 1.0f : 0.0f;
+        mCamera.u[a] = a == 0 ? 1.0f : 0.0f;
+        mCamera.v[a] = a == 1 ? -1.0f : 0.0f;
+        mLight[a] = 0.0f;
+        mBackground[a] = 0.0f;
+    }
+    RenderMaterial mat = {};
+    for (int a = 0; a < 3; a++)
+        mat.diffColor[a] = 0.7f;
+    mMaterial = mat;
+    mStep = 0.25f;
+    mNumSamples = 0;
+}
+
+void LevelSetRendererCPU::SetLight(const float pos[3]) {
+    for (int a = 0; a < 3; a++)
+        mLight[a] = pos[a];
+}
+
+void LevelSetRendererCPU::SetBackground(const float clr[3]) {
+    for (int a = 0; a < 3; a++)
+        mBackground[a] = clr[a];
+}
+
+void LevelSetRendererCPU::SetStep(float step) { mStep = std::max(step, 0.01f); }
+
+void LevelSetRendererCPU::UpdateVolume(SparseGrid &grid, int chan, float background) {
+    mPyramid.Build(grid, chan, background);
+}
+
+void LevelSetRendererCPU::getNormal(const float p[3], float n[3]) const {
+    const float h = 0.5f;
+    for (int a = 0; a < 3; a++) {
+        float lo[3] = {p[0], p[1], p[2]}, hi[3] = {p[0], p[1], p[2]};
+        lo[a] -= h;
+        hi[a] += h;
+        n[a] = mPyramid.Sample(hi) - mPyramid.Sample(lo);
+    }
+    if (dot3(n, n) == 0.0f)
+        n[1] = 1.0f;
+    normalize3(n);
+}
+
+bool LevelSetRendererCPU::intersect(const float o[3], const float d[3], float tMin, float tMax,
+                                    Hit &hit, long long &samples) const {
+    // March the spans that may hold the surface, keeping the step across them. Skipped space
+    // has one sign throughout, so a crossing before it still changes the sign of the first
+    // sample after it.
+    float prevT = 0.0f, prevV = 0.0f;
+    bool havePrev = false, found = false;
+    mPyramid.Traverse(o, d, tMin, tMax, 0.0f, [&](const PyramidSpan &span) {
+        float t = havePrev ? std::max(span.tEnter, prevT + mStep) : span.tEnter;
+        for (; t <= span.tExit; t += mStep) {
+            float p[3] = {o[0] + t * d[0], o[1] + t * d[1], o[2] + t * d[2]};
+            float v = mPyramid.Sample(p);
+            samples++;
+            if (havePrev && (v < 0.0f) != (prevV < 0.0f)) {
+                // Zero crossing between the last two samples
+                float a = prevT, b = t;
+                for (int i = 0; i < BISECTION_STEPS; i++) {
+                    float m = 0.5f * (a + b);
+                    float q[3] = {o[0] + m * d[0], o[1] + m * d[1], o[2] + m * d[2]};
+                    if ((mPyramid.Sample(q) < 0.0f) == (prevV < 0.0f))
+                        a = m;
+                    else
+                        b = m;
+                }
+                samples += BISECTION_STEPS;
+                hit.t = 0.5f * (a + b);
+                for (int i = 0; i < 3; i++)
+                    hit.pos[i] = o[i] + hit.t * d[i];
+                getNormal(hit.pos, hit.normal);
+                found = true;
+                return false;
+            }
+            prevT = t;
+            prevV = v;
+            havePrev = true;
+        }
+        return true;
+    });
+    return found;
+}
+
+void LevelSetRendererCPU::trace(const float o[3], const float d[3], int depth, bool refractRay,
+                                float rgb[3], float &length, long long &samples) const {
+    Hit hit;
+    // vol_levelset reports no surface to refraction rays of depth 2
+    if ((refractRay && depth >= REFRACT_DEPTH) || !intersect(o, d, 0.0f, FLT_MAX, hit, samples)) {
+        for (int a = 0; a < 3; a++)
+            rgb[a] = mBackground[a];
+        length = NO_HIT_LENGTH;
+        return;
+    }
+    shade(hit, d, depth, rgb, samples);
+    length = hit.t;
+}
+
+void LevelSetRendererCPU::shade(const Hit &hit, const float d[3], int depth, float rgb[3],
+                                long long &samples) const {
+    const RenderMaterial &mat = mMaterial;
+    const float *n = hit.normal;
+    const float *p = hit.pos;
+
+    float lightDir[3] = {mLight[0] - p[0], mLight[1] - p[1], mLight[2] - p[2]};
+    normalize3(lightDir);
+    float half[3] = {lightDir[0] - d[0], lightDir[1] - d[1], lightDir[2] - d[2]};
+    normalize3(half);
+    float diffuse = std::max(0.0f, dot3(n, lightDir));
+    float spec = std::pow(std::max(0.0f, dot3(n, half)), mat.specPower);
+    if (mat.envColor[0] == 1.0f) {
+        // Checker pattern
+        int cell = (int)(std::floor(p[0] / mat.envColor[1]) + std::floor(p[2] / mat.envColor[1]));
+        if (cell & 1)
+            diffuse *= mat.envColor[2];
+    }
+
+    float refl[3] = {0.0f, 0.0f, 0.0f};
+    float refr[3] = {0.0f, 0.0f, 0.0f};
+    float shadow = 1.0f;
+    float length;
+    if (depth < REFLECT_DEPTH && mat.reflWidth > 0.0f) {
+        float cosI = -dot3(n, d);
+        float dir[3], o[3];
+        for (int a = 0; a < 3; a++)
+            dir[a] = 2.0f * cosI * n[a] + d[a];
+        normalize3(dir);
+        for (int a = 0; a < 3; a++)
+            o[a] = p[a] + dir[a] * mat.reflBias;
+        trace(o, dir, depth + 1, false, refl, length, samples);
+        for (int a = 0; a < 3; a++)
+            refl[a] *= mat.reflColor[a];
+    }
+    float dir[3];
+    if (depth < REFRACT_DEPTH && mat.refrWidth > 0.0f && refract(dir, d, n, mat.refrIor)) {
+        float o[3];
+        for (int a = 0; a < 3; a++)
+            o[a] = p[a] + dir[a] * mat.refrBias;
+        trace(o, dir, depth + 1, true, refr, length, samples);
+        float f = std::min(1.0f, length / mat.refrOffset);
+        for (int a = 0; a < 3; a++)
+            refr[a] = refr[a] * mat.refrAmount * (1.0f - f) + mat.refrColor[a] * f;
+    }
+    if (depth < SHADOW_DEPTH) {
+        float o[3];
+        for (int a = 0; a < 3; a++)
+            o[a] = p[a] + lightDir[a] * mat.shadowBias;
+        Hit blocker;
+        if (intersect(o, lightDir, 0.0f, FLT_MAX, blocker, samples))
+            shadow = 0.0f;
+    }
+
+    for (int a = 0; a < 3; a++) {
+        float direct = mat.diffColor[a] * diffuse + mat.specColor[a] * spec + mat.ambColor[a];
+        rgb[a] = direct * shadow + (refl[a] + refr[a]) * (shadow * 0.3f + 0.7f);
+    }
+}
+
+void LevelSetRendererCPU::Render(std::vector<float> &rgb, int w, int h) {
+    rgb.resize((size_t)w * h * 3);
+    int tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+    int numThreads = mPool ? mPool->getNumThreads() : 1;
+    std::vector<long long> threadSamples(numThreads, 0);
+
+    // One tile per item: tiles covering the surface cost far more than background tiles, so
+    // threads take them one at a time
+    ThreadPool::RangeFunc renderTiles = [&](int begin, int end, int thread) {
+        long long samples = 0;
+        for (int tile = begin; tile < end; tile++) {
+            int x0 = (tile % tilesX) * TILE_SIZE, y0 = (tile / tilesX) * TILE_SIZE;
+            int x1 = std::min(x0 + TILE_SIZE, w), y1 = std::min(y0 + TILE_SIZE, h);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    float fx = (float)x / w, fy = (float)y / h;
+                    float dir[3];
+                    for (int a = 0; a < 3; a++)
+                        dir[a] = mCamera.corner[a] + fx * mCamera.u[a] + fy * mCamera.v[a];
+                    normalize3(dir);
+                    float length;
+                    trace(mCamera.pos, dir, 0, false, &rgb[((size_t)y * w + x) * 3], length,
+                          samples);
+                }
+            }
+        }
+        threadSamples[thread] += samples;
+    };
+    runRange(mPool, tilesX * tilesY, 1, renderTiles);
+
+    mNumSamples = 0;
+    for (int t = 0; t < numThreads; t++)
+        mNumSamples += threadSamples[t];
+}
@@ -0,0 +1,101 @@
+#ifndef RENDER_CPU_H
+#define RENDER_CPU_H
+
+#include "occupancy_pyramid.h"
+#include "sparse_grid.h"
+#include "thread_pool.h"
+#include <vector>
+
+// Pinhole camera in grid units with the rays of OptixScene::SetCamera and trace_primary: pixel
+// (x, y) of a w x h image looks along corner + x / w * u + y / h * v
+struct RenderCamera {
+    float pos[3];
+    float corner[3]; // Top left image corner (Camera3D::tlRayWorld)
+    float u[3];      // Top left to top right corner
+    float v[3];      // Top left to bottom left corner
+};
+
+// Surface shading terms of MaterialParams, as used by trace_surface in optix_trace_surface.cu
+struct RenderMaterial {
+    float ambColor[3];
+    float diffColor[3];
+    float specColor[3];
+    float specPower;
+    float envColor[3]; // x = 1: checker floor of cell size y and dark level z
+    float shadowBias;
+    float reflWidth; // Reflections when > 0
+    float reflBias;
+    float reflColor[3];
+    float refrWidth; // Refraction when > 0
+    float refrIor;
+    float refrColor[3];
+    float refrAmount;
+    float refrOffset;
+    float refrBias;
+};
+
+// Multithreaded CPU ray marcher for a level set channel of a SparseGrid (negative inside), used
+// when frames cannot be rendered with OptiX. The image is split into tiles that the pool threads
+// take dynamically. Rays walk the occupancy pyramid of the level set, so only brick regions
+// that may hold the surface are marched and refined by bisection. Shading follows
+// trace_surface with one deterministic sample per pixel: diffuse, specular and ambient terms, a
+// hard shadow, one reflection bounce and refraction through the surface.
+class LevelSetRendererCPU {
+  public:
+    LevelSetRendererCPU();
+
+    void SetPool(ThreadPool *pool) {
+        mPool = pool;
+        mPyramid.SetPool(pool);
+    }
+    void SetCamera(const RenderCamera &cam) { mCamera = cam; }
+    void SetLight(const float pos[3]);
+    void SetMaterial(const RenderMaterial &mat) { mMaterial = mat; }
+    void SetBackground(const float clr[3]);
+    void SetStep(float step); // March step in surface regions, grid units
+
+    // Take the level set channel of `grid` and rebuild its pyramid, after every change of the
+    // channel or the topology. Nodes outside the active bricks read `background`.
+    void UpdateVolume(SparseGrid &grid, int chan, float background);
+
+    // Render a w x h float RGB image (3 floats per pixel, top row first), the layout of the
+    // OptiX output buffer read by OptixScene::SaveOutput and ReadOutput
+    void Render(std::vector<float> &rgb, int w, int h);
+
+    // Level set samples taken by the last Render, for profiling the empty space skipping
+    long long getNumSamples() const { return mNumSamples; }
+
+    // Pyramid of the last UpdateVolume, for picking and other queries on the level set
+    const OccupancyPyramid &getPyramid() const { return mPyramid; }
+
+  private:
+    struct Hit {
+        float t;
+        float pos[3];
+        float normal[3]; // Level set gradient, points outside
+    };
+
+    void getNormal(const float p[3], float n[3]) const;
+
+    // First zero crossing of the level set along o + t d with t in (tMin, tMax)
+    bool intersect(const float o[3], const float d[3], float tMin, float tMax, Hit &hit,
+                   long long &samples) const;
+
+    // Colour of a ray, as the OptiX ray types: depth 0 is the camera ray
+    void trace(const float o[3], const float d[3], int depth, bool refractRay, float rgb[3],
+               float &length, long long &samples) const;
+    void shade(const Hit &hit, const float d[3], int depth, float rgb[3],
+               long long &samples) const;
+
+    ThreadPool *mPool;
+    RenderCamera mCamera;
+    RenderMaterial mMaterial;
+    float mLight[3];
+    float mBackground[3];
+    float mStep;
+
+    OccupancyPyramid mPyramid;
+    long long mNumSamples;
+};
+
+#endif
@@ -690,6 +690,20 @@ void OptixScene::SaveOutput(char* fname)
 	free(pix_buf);
 }
 
+void OptixScene::ReadOutput ( std::vector<float>& rgb, int& w, int& h )
+{
+	// copy the float RGB output, so that it can be saved on another thread
+	RTsize bw, bh;
+	m_OptixBuffer->getSize ( bw, bh );
+	w = (int) bw;
+	h = (int) bh;
+	rgb.resize ( bw*bh * 3 );
+
+	float* dat = (float*) m_OptixBuffer->map();
+	memcpy ( &rgb[0], dat, bw*bh * 3 * sizeof(float) );
+	m_OptixBuffer->unmap();
+}
+
 void OptixScene::ReadOutputTex ( int out_tex )
 {
 	// Target output to OpenGL texture
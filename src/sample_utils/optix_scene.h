@@ -35,6 +35,7 @@
 	using namespace optix;
 
 	#include "gvdb.h"
+	#include <vector>
 
 	struct MaterialParams {
 		char		name[64];
@@ -122,6 +123,7 @@
 
 		void	ReadOutputTex ( int out_tex );
 		void	SaveOutput (char* fname);
+		void	ReadOutput ( std::vector<float>& rgb, int& w, int& h );		// float RGB copy of the output
 		
 		void*	getContext()	{ return &m_OptixContext; }
 		MaterialParams* getMaterialParams( int n )	{ return &m_OptixMatParams[n]; }
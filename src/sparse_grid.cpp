@@ -0,0 +1,431 @@
+#include "sparse_grid.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string.h>
+
+#define PARTICLE_GRAIN 4096
+#define BRICK_GRAIN 16
+#define CHURN_LIMIT 8 // Incremental rebuilds handle up to 1 / CHURN_LIMIT of changed particles
+
+#define KEY_BITS 21
+#define KEY_MASK ((1ull << KEY_BITS) - 1)
+#define KEY_OFFSET (1 << (KEY_BITS - 1)) // Allows negative brick coordinates
+#define EMPTY_KEY (~0ull)
+
+static inline uint64_t hashKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+SparseGrid::SparseGrid() {
+    mPool = 0;
+    SetStencil(2, 3);
+    for (int l = 0; l < GRID_MAX_LEVELS; l++) {
+        mLog2[l] = 3;
+        mLevelNodes[l] = 0;
+    }
+    for (int c = 0; c < GRID_CHANNELS; c++)
+        mFormats[c] = CHANNEL_FP32;
+    mIncremental = false;
+    mNumActivated = 0;
+    mNumDeactivated = 0;
+}
+
+void SparseGrid::Configure(int q4, int q3, int q2, int q1, int q0) {
+    mLog2[0] = q0;
+    mLog2[1] = q1;
+    mLog2[2] = q2;
+    mLog2[3] = q3;
+    mLog2[4] = q4;
+}
+
+void SparseGrid::SetStencil(int order, int dim) {
+    mStencilOrder = order;
+    mDimension = dim;
+    mStencilShift = (order - 1) * 0.5f;
+    mParticleKeys.clear(); // Recorded stencils are stale
+}
+
+void SparseGrid::SetIncremental(bool incremental) {
+    mIncremental = incremental;
+    mParticleKeys.clear();
+    mParticleSpans.clear();
+    mBrickRefs.clear();
+}
+
+uint64_t SparseGrid::packKey(int bx, int by, int bz) {
+    return ((uint64_t)((bz + KEY_OFFSET) & KEY_MASK) << (2 * KEY_BITS)) |
+           ((uint64_t)((by + KEY_OFFSET) & KEY_MASK) << KEY_BITS) |
+           (uint64_t)((bx + KEY_OFFSET) & KEY_MASK);
+}
+
+void SparseGrid::unpackKey(uint64_t key, int *coord) {
+    coord[0] = (int)(key & KEY_MASK) - KEY_OFFSET;
+    coord[1] = (int)((key >> KEY_BITS) & KEY_MASK) - KEY_OFFSET;
+    coord[2] = (int)((key >> (2 * KEY_BITS)) & KEY_MASK) - KEY_OFFSET;
+}
+
+uint64_t SparseGrid::getStencilKey(const float *const pos[3], int p, int &span) const {
+    const int brickLog2 = mLog2[0];
+    int lo[3];
+    span = 0;
+    for (int a = 0; a < 3; a++) {
+        int base = getStencilBase(pos[a][p], a);
+        lo[a] = base >> brickLog2;
+        if (((base + getStencilSize(a) - 1) >> brickLog2) != lo[a])
+            span |= 1 << a;
+    }
+    return packKey(lo[0], lo[1], lo[2]);
+}
+
+// Brick keys of a stencil, the stencil spans at most 2 bricks per axis
+static inline int expandStencil(uint64_t key, int span, uint64_t *keys) {
+    int count = 0;
+    for (int z = 0; z <= ((span >> 2) & 1); z++)
+        for (int y = 0; y <= ((span >> 1) & 1); y++)
+            for (int x = 0; x <= (span & 1); x++)
+                keys[count++] = key + ((uint64_t)z << (2 * KEY_BITS)) +
+                                ((uint64_t)y << KEY_BITS) + (uint64_t)x;
+    return count;
+}
+
+bool SparseGrid::RebuildTopology(const ParticleSet &particles) {
+    if (!mIncremental || !rebuildIncremental(particles)) {
+        int previous = getNumBricks();
+        if (!rebuildFull(particles)) {
+            releaseTopology();
+            return false;
+        }
+        mNumActivated = getNumBricks();
+        mNumDeactivated = previous;
+        if (mIncremental)
+            countReferences();
+    }
+    ClearChannels();
+    return true;
+}
+
+bool SparseGrid::rebuildFull(const ParticleSet &particles) {
+    int numPoints = particles.getCount();
+    const float *pos[3] = {particles.getComponent(PARTICLE_POSITION, 0),
+                           particles.getComponent(PARTICLE_POSITION, 1),
+                           particles.getComponent(PARTICLE_POSITION, 2)};
+    if (mIncremental) {
+        mParticleKeys.resize(numPoints);
+        mParticleSpans.resize(numPoints);
+    }
+
+    // Brick keys touched by each chunk of particles, deduplicated per chunk. Particles of a
+    // chunk are mostly close together, so the per-thread lists stay short.
+    int numThreads = mPool->getNumThreads();
+    mThreadKeys.resize(numThreads);
+    for (int t = 0; t < numThreads; t++)
+        mThreadKeys[t].keys.clear();
+    mPool->parallelFor(numPoints, PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        std::vector<uint64_t> &keys = mThreadKeys[thread].keys;
+        size_t first = keys.size();
+        uint64_t lastKey = EMPTY_KEY;
+        for (int p = begin; p < end; p++) {
+            int span;
+            uint64_t stencil[8];
+            uint64_t key = getStencilKey(pos, p, span);
+            if (mIncremental) {
+                mParticleKeys[p] = key;
+                mParticleSpans[p] = (unsigned char)span;
+            }
+            int count = expandStencil(key, span, stencil);
+            for (int k = 0; k < count; k++) {
+                if (stencil[k] != lastKey)
+                    keys.push_back(stencil[k]);
+                lastKey = stencil[k];
+            }
+        }
+        std::sort(keys.begin() + first, keys.end());
+        keys.erase(std::unique(keys.begin() + first, keys.end()), keys.end());
+    });
+
+    std::vector<uint64_t> &keys = mSortKeys;
+    keys.clear();
+    for (int t = 0; t < numThreads; t++)
+        keys.insert(keys.end(), mThreadKeys[t].keys.begin(), mThreadKeys[t].keys.end());
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    int numBricks = (int)keys.size();
+    mBrickCoords.resize(numBricks * 3);
+    for (int b = 0; b < numBricks; b++)
+        unpackKey(keys[b], &mBrickCoords[b * 3]);
+    buildLookup();
+    return finishTopology();
+}
+
+void SparseGrid::countReferences() {
+    int numPoints = (int)mParticleKeys.size();
+    mBrickRefs.assign(getNumBricks(), 0);
+    mPool->parallelFor(numPoints, PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for (int p = begin; p < end; p++) {
+            uint64_t stencil[8];
+            int count = expandStencil(mParticleKeys[p], mParticleSpans[p], stencil);
+            for (int k = 0; k < count; k++) {
+                int b = mHashValues[findSlot(stencil[k])];
+                reinterpret_cast<std::atomic<int> *>(&mBrickRefs[b])->fetch_add(
+                    1, std::memory_order_relaxed);
+            }
+        }
+    });
+}
+
+bool SparseGrid::rebuildIncremental(const ParticleSet &particles) {
+    int numPoints = particles.getCount();
+    int recorded = (int)mParticleKeys.size();
+    if (recorded == 0 || getNumBricks() == 0)
+        return false;
+    const float *pos[3] = {particles.getComponent(PARTICLE_POSITION, 0),
+                           particles.getComponent(PARTICLE_POSITION, 1),
+                           particles.getComponent(PARTICLE_POSITION, 2)};
+
+    // Stencil bricks of the particles whose stencil changed, before and after. Removed particles
+    // only release their bricks, added ones only take theirs.
+    int numThreads = mPool->getNumThreads();
+    mThreadKeys.resize(numThreads);
+    for (int t = 0; t < numThreads; t++) {
+        mThreadKeys[t].added.clear();
+        mThreadKeys[t].removed.clear();
+        mThreadKeys[t].changed = 0;
+    }
+    int total = std::max(numPoints, recorded);
+    mParticleKeys.resize(total);
+    mParticleSpans.resize(total);
+    mPool->parallelFor(total, PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        std::vector<uint64_t> &added = mThreadKeys[thread].added;
+        std::vector<uint64_t> &removed = mThreadKeys[thread].removed;
+        int changed = 0;
+        for (int p = begin; p < end; p++) {
+            uint64_t stencil[8];
+            int span = 0;
+            uint64_t key = p < numPoints ? getStencilKey(pos, p, span) : EMPTY_KEY;
+            if (p < recorded && key == mParticleKeys[p] && span == mParticleSpans[p])
+                continue;
+            changed++;
+            if (p < recorded) {
+                int count = expandStencil(mParticleKeys[p], mParticleSpans[p], stencil);
+                removed.insert(removed.end(), stencil, stencil + count);
+            }
+            if (p < numPoints) {
+                int count = expandStencil(key, span, stencil);
+                added.insert(added.end(), stencil, stencil + count);
+            }
+            mParticleKeys[p] = key;
+            mParticleSpans[p] = (unsigned char)span;
+        }
+        mThreadKeys[thread].changed += changed;
+    });
+    mParticleKeys.resize(numPoints);
+    mParticleSpans.resize(numPoints);
+
+    // Too much churn for the serial update, as after a particle sort
+    int changed = 0;
+    for (int t = 0; t < numThreads; t++)
+        changed += mThreadKeys[t].changed;
+    if (changed > numPoints / CHURN_LIMIT)
+        return false;
+
+    // Take the new references before releasing the old ones, so bricks that only change
+    // particles stay active
+    mNumActivated = mNumDeactivated = 0;
+    for (int t = 0; t < numThreads; t++) {
+        const std::vector<uint64_t> &added = mThreadKeys[t].added;
+        for (size_t k = 0; k < added.size(); k++) {
+            uint64_t key = added[k];
+            int b = mHashValues[findSlot(key)];
+            if (b < 0) {
+                activateBrick(key);
+                b = getNumBricks() - 1;
+            }
+            mBrickRefs[b]++;
+        }
+    }
+    for (int t = 0; t < numThreads; t++) {
+        const std::vector<uint64_t> &removed = mThreadKeys[t].removed;
+        for (size_t k = 0; k < removed.size(); k++) {
+            int b = mHashValues[findSlot(removed[k])];
+            if (--mBrickRefs[b] == 0)
+                deactivateBrick(b);
+        }
+    }
+    if ((mNumActivated || mNumDeactivated) && !finishTopology()) {
+        // The recorded stencils no longer match the bricks, retry from scratch
+        releaseTopology();
+        return false;
+    }
+    return true;
+}
+
+void SparseGrid::activateBrick(uint64_t key) {
+    int b = getNumBricks();
+    mBrickCoords.resize(mBrickCoords.size() + 3);
+    unpackKey(key, &mBrickCoords[b * 3]);
+    mBrickRefs.push_back(0);
+    mNumActivated++;
+    if ((size_t)(b + 1) * 2 > mHashKeys.size()) {
+        buildLookup();
+        return;
+    }
+    size_t slot = findSlot(key);
+    mHashKeys[slot] = key;
+    mHashValues[slot] = b;
+}
+
+void SparseGrid::deactivateBrick(int b) {
+    int last = getNumBricks() - 1;
+    const int *c = &mBrickCoords[b * 3];
+    eraseSlot(findSlot(packKey(c[0], c[1], c[2])));
+    if (b != last) {
+        // The last brick takes the free place
+        const int *lc = &mBrickCoords[last * 3];
+        mHashValues[findSlot(packKey(lc[0], lc[1], lc[2]))] = b;
+        for (int a = 0; a < 3; a++)
+            mBrickCoords[b * 3 + a] = lc[a];
+        mBrickRefs[b] = mBrickRefs[last];
+    }
+    mBrickCoords.resize(last * 3);
+    mBrickRefs.pop_back();
+    mNumDeactivated++;
+}
+
+bool SparseGrid::finishTopology() {
+    // Active nodes of the upper levels: bricks grouped by their ancestor at each level
+    int numBricks = getNumBricks();
+    mLevelNodes[0] = numBricks;
+    int shift = 0;
+    std::vector<uint64_t> &ancestors = mSortKeys;
+    ancestors.resize(numBricks);
+    for (int l = 1; l < GRID_MAX_LEVELS; l++) {
+        shift += mLog2[l];
+        for (int b = 0; b < numBricks; b++) {
+            const int *c = &mBrickCoords[b * 3];
+            ancestors[b] = packKey(c[0] >> shift, c[1] >> shift, c[2] >> shift);
+        }
+        std::sort(ancestors.begin(), ancestors.end());
+        mLevelNodes[l] = (int)(std::unique(ancestors.begin(), ancestors.end()) - ancestors.begin());
+    }
+
+    mBricks.Configure(GRID_CHANNELS, getBrickNodes());
+    for (int c = 0; c < GRID_CHANNELS; c++)
+        mBricks.SetChannelBytes(c, getChannelFormatBytes(mFormats[c]));
+    return mBricks.Resize(numBricks);
+}
+
+void SparseGrid::releaseTopology() {
+    mBrickCoords.clear();
+    mParticleKeys.clear();
+    mParticleSpans.clear();
+    mBrickRefs.clear();
+    for (int l = 0; l < GRID_MAX_LEVELS; l++)
+        mLevelNodes[l] = 0;
+    buildLookup();
+    mBricks.Resize(0);
+}
+
+void SparseGrid::buildLookup() {
+    int numBricks = getNumBricks();
+    size_t size = 16;
+    while (size < (size_t)numBricks * 2)
+        size *= 2;
+    mHashKeys.assign(size, EMPTY_KEY);
+    mHashValues.assign(size, -1);
+
+    for (int b = 0; b < numBricks; b++) {
+        const int *c = &mBrickCoords[b * 3];
+        uint64_t key = packKey(c[0], c[1], c[2]);
+        size_t slot = findSlot(key);
+        mHashKeys[slot] = key;
+        mHashValues[slot] = b;
+    }
+}
+
+size_t SparseGrid::findSlot(uint64_t key) const {
+    size_t mask = mHashKeys.size() - 1;
+    size_t slot = hashKey(key) & mask;
+    while (mHashKeys[slot] != key && mHashKeys[slot] != EMPTY_KEY)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+void SparseGrid::eraseSlot(size_t slot) {
+    // Backward shift: move up every later key of the probe sequence that may take the slot
+    size_t mask = mHashKeys.size() - 1;
+    for (size_t next = (slot + 1) & mask; mHashKeys[next] != EMPTY_KEY; next = (next + 1) & mask) {
+        size_t home = hashKey(mHashKeys[next]) & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            mHashKeys[slot] = mHashKeys[next];
+            mHashValues[slot] = mHashValues[next];
+            slot = next;
+        }
+    }
+    mHashKeys[slot] = EMPTY_KEY;
+    mHashValues[slot] = -1;
+}
+
+int SparseGrid::FindBrick(int bx, int by, int bz) const {
+    if (mHashKeys.empty())
+        return -1;
+    uint64_t key = packKey(bx, by, bz);
+    size_t mask = mHashKeys.size() - 1;
+    for (size_t slot = hashKey(key) & mask;; slot = (slot + 1) & mask) {
+        if (mHashKeys[slot] == key)
+            return mHashValues[slot];
+        if (mHashKeys[slot] == EMPTY_KEY)
+            return -1;
+    }
+}
+
+void SparseGrid::ClearChannels() {
+    for (int c = 0; c < GRID_CHANNELS; c++)
+        ClearChannel(c);
+}
+
+void SparseGrid::ClearChannel(int chan) {
+    // All-zero bits are +0 in every channel format
+    size_t brickBytes = (size_t)getBrickNodes() * getChannelFormatBytes(mFormats[chan]);
+    char *data = (char *)getChannelData(chan);
+    if (!data)
+        return;
+    mPool->parallelFor(getNumBricks(), BRICK_GRAIN, [&](int begin, int end, int thread) {
+        memset(data + begin * brickBytes, 0, (end - begin) * brickBytes);
+    });
+}
+
+void SparseGrid::SetChannelFormat(int chan, int format) {
+    if (mFormats[chan] == format)
+        return;
+    mFormats[chan] = format;
+    if (getNumBricks() == 0)
+        return; // The pool is configured by the next rebuild
+    mBricks.SetChannelBytes(chan, getChannelFormatBytes(format));
+    if (!mBricks.Resize(getNumBricks())) {
+        releaseTopology(); // The next RebuildTopology reports the failure
+        return;
+    }
+    ClearChannels();
+}
+
+bool SparseGrid::hasReducedChannels() const {
+    for (int c = 0; c < GRID_CHANNELS; c++) {
+        if (mFormats[c] != CHANNEL_FP32)
+            return true;
+    }
+    return false;
+}
+
+size_t SparseGrid::getMemoryUsage() const {
+    size_t bytes = mBrickCoords.size() * sizeof(int) + mHashKeys.size() * sizeof(uint64_t) +
+                   mHashValues.size() * sizeof(int) + mParticleKeys.size() * sizeof(uint64_t) +
+                   mParticleSpans.size() + mBrickRefs.size() * sizeof(int);
+    bytes += mBricks.getMemoryUsage();
+    return bytes;
+}
@@ -0,0 +1,143 @@
+#ifndef SPARSE_GRID_H
+#define SPARSE_GRID_H
+
+#include "brick_pool.h"
+#include "channel_format.h"
+#include "particle_set.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+
+#define GRID_MAX_LEVELS 5
+#define GRID_CHANNELS 8 // Same channel numbering as the GVDB channels set up in Sample::init
+
+// CPU counterpart of the GVDB topology: a sparse hierarchy of levels where level 0 nodes are
+// bricks of grid nodes and every upper-level node covers a block of nodes of the level below.
+// Only bricks touched by particles are allocated. Bricks are found through an open-addressing
+// hash table keyed by brick coordinates; every brick stores GRID_CHANNELS channels.
+//
+// Channel c of brick b, node (x, y, z) inside the brick:
+//   getChannel(c)[b * getBrickNodes() + (z * res + y) * res + x]   (res = getBrickRes())
+class SparseGrid {
+  public:
+    SparseGrid();
+
+    // Log2 of the node resolution of each level, top level first, as in VolumeGVDB::Configure.
+    // Configure(3, 3, 3, 3, 3) gives 8^3 bricks and a 32768^3 node domain.
+    void Configure(int q4, int q3, int q2, int q1, int q0);
+    void SetPool(ThreadPool *pool) { mPool = pool; }
+
+    // Stencil of the transfers, B-spline order 1-3 and dimension 2 or 3. Defaults to quadratic
+    // 3D. Along axis a, a particle at x reaches nodes getStencilBase(x, a) .. + order; in 2D
+    // the z axis only reaches the nearest node.
+    void SetStencil(int order, int dim);
+    int getStencilBase(float x, int axis) const {
+        return (int)std::floor(axis < mDimension ? x - mStencilShift : x + 0.5f);
+    }
+    int getStencilSize(int axis) const { return axis < mDimension ? mStencilOrder + 1 : 1; }
+
+    // Activate every brick holding a node of a particle's stencil and clear all channels.
+    // Returns false, leaving no active bricks, when the brick pool cannot hold them.
+    bool RebuildTopology(const ParticleSet &particles);
+
+    // Incremental topology: every particle keeps the bricks of its stencil and every brick the
+    // number of particles reaching it, so RebuildTopology only activates the bricks particles
+    // moved into and deactivates the ones no particle reaches any more. Bricks are then no
+    // longer sorted, and a deactivated brick takes the place of the last one. Steps where many
+    // particles change stencil bricks (after a sort) rebuild from scratch. Off by default.
+    void SetIncremental(bool incremental);
+    bool getIncremental() const { return mIncremental; }
+    // Bricks activated and deactivated by the last RebuildTopology, all of them for a full build
+    int getNumActivated() const { return mNumActivated; }
+    int getNumDeactivated() const { return mNumDeactivated; }
+    void ClearChannels();
+    void ClearChannel(int chan);
+
+    int getBrickLog2() const { return mLog2[0]; }
+    int getBrickRes() const { return 1 << mLog2[0]; }
+    int getBrickNodes() const { return 1 << (3 * mLog2[0]); }
+    int getNumBricks() const { return (int)mBrickCoords.size() / 3; }
+    int getNumNodes(int level) const { return mLevelNodes[level]; }
+    int getNumLevels() const { return GRID_MAX_LEVELS; }
+    int getLevelLog2(int level) const { return mLog2[level]; }
+
+    // Brick coordinates (node coordinates / brick resolution) of brick b
+    const int *getBrickCoord(int b) const { return &mBrickCoords[b * 3]; }
+
+    // Brick index from brick coordinates, -1 if the brick is not active
+    int FindBrick(int bx, int by, int bz) const;
+
+    // Storage format of a channel, CHANNEL_FP32 by default. getChannel and getBrickChannel are
+    // only valid for fp32 channels; reduced ones are accessed through getChannelData with the
+    // conversions of channel_format.h. Changing a format reallocates the bricks and clears all
+    // channels, or drops the bricks if they no longer fit.
+    void SetChannelFormat(int chan, int format);
+    int getChannelFormat(int chan) const { return mFormats[chan]; }
+    bool hasReducedChannels() const;
+
+    float *getChannel(int chan) { return mBricks.getChannel(chan); }
+    float *getBrickChannel(int b, int chan) {
+        return mBricks.getChannel(chan) + (size_t)b * getBrickNodes();
+    }
+    void *getChannelData(int chan) { return mBricks.getChannelData(chan); }
+
+    // Brick storage grows by chunks of bricks (BRICK_POOL_CHUNK by default) and keeps its
+    // high-water mark across topology changes until TrimPool
+    void SetPoolChunk(int chunkBricks) { mBricks.SetChunk(chunkBricks); }
+    void TrimPool() { mBricks.Trim(); }
+    const BrickPool &getBrickPool() const { return mBricks; }
+
+    size_t getMemoryUsage() const;
+
+  private:
+    static uint64_t packKey(int bx, int by, int bz);
+    static void unpackKey(uint64_t key, int *coord);
+    // Lowest stencil brick of a particle, and the axes where the stencil reaches the next brick
+    // as bits 0-2 of `span`
+    uint64_t getStencilKey(const float *const pos[3], int p, int &span) const;
+    bool rebuildFull(const ParticleSet &particles);
+    // False when the step needs a full rebuild
+    bool rebuildIncremental(const ParticleSet &particles);
+    void countReferences();
+    void activateBrick(uint64_t key);
+    void deactivateBrick(int b);
+    bool finishTopology(); // False if the brick pool cannot grow
+    void releaseTopology(); // Drop all bricks after a failed rebuild
+    void buildLookup();
+    size_t findSlot(uint64_t key) const; // Slot of the key, or the empty slot ending its probe
+    void eraseSlot(size_t slot);
+
+    ThreadPool *mPool;
+    int mLog2[GRID_MAX_LEVELS]; // Level 0 (bricks) first
+    int mStencilOrder;
+    int mDimension;
+    float mStencilShift; // (order - 1) / 2
+
+    std::vector<int> mBrickCoords;   // 3 ints per brick, sorted by z, y, x
+    std::vector<uint64_t> mHashKeys; // Open addressing, power of two size
+    std::vector<int> mHashValues;    // Brick index per hash slot
+    int mLevelNodes[GRID_MAX_LEVELS];
+    BrickPool mBricks; // GRID_CHANNELS channels per brick
+    int mFormats[GRID_CHANNELS];
+
+    bool mIncremental;
+    std::vector<uint64_t> mParticleKeys;       // Stencil key per particle, incremental mode
+    std::vector<unsigned char> mParticleSpans; // Stencil span per particle
+    std::vector<int> mBrickRefs;               // Particles reaching each brick
+    int mNumActivated;
+    int mNumDeactivated;
+
+    // Per-thread rebuild buffers, which keep their capacity between steps so that steady
+    // state rebuilds do not allocate
+    struct ThreadKeys {
+        std::vector<uint64_t> keys;    // Stencil bricks, full rebuild
+        std::vector<uint64_t> added;   // Stencil bricks taken, incremental rebuild
+        std::vector<uint64_t> removed; // Stencil bricks released
+        int changed;                   // Particles with a new stencil
+    };
+    std::vector<ThreadKeys> mThreadKeys;
+    std::vector<uint64_t> mSortKeys; // Merged brick keys, then brick ancestors
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int numThreads) {
+    if (numThreads <= 0)
+        numThreads = (int)std::thread::hardware_concurrency();
+    if (numThreads <= 0)
+        numThreads = 1;
+
+    m_numThreads = numThreads;
+    m_generation = 0;
+    m_busyWorkers = 0;
+    m_stop = false;
+    m_func = 0;
+    m_count = 0;
+    m_grain = 1;
+    m_nextChunk = 0;
+
+    for (int t = 1; t < m_numThreads; t++)
+        m_workers.push_back(std::thread(&ThreadPool::workerLoop, this, t));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (size_t i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+}
+
+void ThreadPool::runChunks(int thread) {
+    for (;;) {
+        int begin = m_nextChunk.fetch_add(m_grain);
+        if (begin >= m_count)
+            break;
+        int end = begin + m_grain < m_count ? begin + m_grain : m_count;
+        (*m_func)(begin, end, thread);
+    }
+}
+
+void ThreadPool::workerLoop(int thread) {
+    unsigned int seenGeneration = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stop && m_generation == seenGeneration)
+                m_wake.wait(lock);
+            if (m_stop)
+                return;
+            seenGeneration = m_generation;
+        }
+
+        runChunks(thread);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busyWorkers == 0)
+                m_done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(int count, int grain, const RangeFunc &fn) {
+    if (count <= 0)
+        return;
+    if (grain < 1)
+        grain = 1;
+
+    // Not worth waking the workers for a single chunk
+    if (m_workers.empty() || count <= grain) {
+        fn(0, count, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_func = &fn;
+        m_count = count;
+        m_grain = grain;
+        m_nextChunk = 0;
+        m_busyWorkers = (int)m_workers.size();
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    runChunks(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_busyWorkers > 0)
+        m_done.wait(lock);
+    m_func = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker pool used by the CPU backend. The calling thread takes part in every
+// parallelFor as thread 0, so a pool of N threads starts N - 1 workers.
+class ThreadPool {
+  public:
+    // Range callback: fn(begin, end, thread), thread is in [0, getNumThreads())
+    typedef std::function<void(int, int, int)> RangeFunc;
+
+    explicit ThreadPool(int numThreads = 0); // 0 = use all hardware threads
+    ~ThreadPool();
+
+    int getNumThreads() const { return m_numThreads; }
+
+    // Split [0, count) into chunks of `grain` items, distributed dynamically over all threads.
+    // Returns when every chunk has been processed.
+    void parallelFor(int count, int grain, const RangeFunc &fn);
+
+  private:
+    void workerLoop(int thread);
+    void runChunks(int thread);
+
+    int m_numThreads;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    unsigned int m_generation;
+    int m_busyWorkers;
+    bool m_stop;
+
+    const RangeFunc *m_func;
+    int m_count;
+    int m_grain;
+    std::atomic<int> m_nextChunk;
+};
+
+#endif
@@ -0,0 +1,27 @@
+// Convert a text particle file (.dat) written by generate_particles.py to the binary format
+// read by Sample::load_points.
+//
+// Usage: convert_particles <in.dat> <out.p2g>
+
+#include "particle_io.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s <in.dat> <out.p2g>\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<float> positions;
+    float initialVolume, mass;
+    if (!readParticleText(argv[1], positions, initialVolume, mass))
+        return 1;
+
+    uint64_t count = positions.size() / 3;
+    if (!writeParticleFile(argv[2], count, initialVolume, mass, &positions[0], 0, 0, 0))
+        return 1;
+
+    printf("Wrote %llu particles to %s\n", (unsigned long long)count, argv[2]);
+    return 0;
+}
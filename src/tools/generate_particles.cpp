@@ -0,0 +1,344 @@
+// Generate particle scenes, a native replacement for assets/generate_particles.py that runs on
+// all cores. Particles sit on a regular lattice with spacing (1 / ppc)^(1/3) cm, clipped to
+// boxes and spheres, optionally jittered. Writes the .dat/.scn pair read by the sample, or a
+// binary .p2g particle file with -format p2g.
+//
+// Usage: generate_particles [options] <name>
+//   -box ox oy oz sx sy sz  Add a box block with origin and size (cm)
+//   -cube ox oy oz          Add a cube block sized to hold -n particles at -ppc
+//   -sphere cx cy cz r      Add a sphere block with center and radius (cm)
+//   -ppc p                  Particles per cell
+//   -n count                Particle count, used to derive -ppc or the -cube size
+//   -density d              Material density in kg/m^3 (default 1000)
+//   -jitter j               Random offset per particle, fraction of the spacing (default 0)
+//   -seed s                 Jitter seed (default 1)
+//   -format dat|p2g         Output format (default dat)
+//   -threads t              Worker threads (default: all hardware threads)
+//
+// Example, same as generate_particles_box_strided for 'small':
+//   generate_particles -box 20 35 20 20 20 20 -ppc 8 small
+
+#include "particle_io.h"
+#include "thread_pool.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define SHAPE_BOX 0
+#define SHAPE_CUBE 1
+#define SHAPE_SPHERE 2
+
+#define PI 3.14159265358979323846
+
+// Particles formatted per task when writing text
+#define TEXT_GRAIN 65536
+
+// Scene written next to every particle file, shared with assets/generate_particles.py
+#define SCENE_TEMPLATE ASSET_PATH "scene_template.scn"
+
+struct Block {
+    int shape;
+    double origin[3]; // Box/cube origin or sphere center (cm)
+    double size[3];   // Box size (cm), size[0] is the sphere radius
+    int steps[3];     // Lattice points per axis
+    std::vector<int64_t> slabStart; // First particle of each x slab
+};
+
+static double blockVolume(const Block &b) {
+    if (b.shape == SHAPE_SPHERE)
+        return 4.0 / 3.0 * PI * b.size[0] * b.size[0] * b.size[0];
+    return b.size[0] * b.size[1] * b.size[2];
+}
+
+// Lattice range of a block, counting points origin + i * stride < origin + size like rangef
+static void setupLattice(Block &b, double stride) {
+    for (int a = 0; a < 3; a++) {
+        double extent = (b.shape == SHAPE_SPHERE) ? 2.0 * b.size[0] : b.size[a];
+        b.steps[a] = (int)ceil(extent / stride);
+        while (b.steps[a] > 0 && (b.steps[a] - 1) * stride >= extent)
+            b.steps[a]--;
+    }
+}
+
+static void latticePoint(const Block &b, double stride, int i, int j, int k, double p[3]) {
+    int idx[3] = {i, j, k};
+    for (int a = 0; a < 3; a++) {
+        double start = (b.shape == SHAPE_SPHERE) ? b.origin[a] - b.size[0] : b.origin[a];
+        p[a] = start + idx[a] * stride;
+    }
+}
+
+static bool inside(const Block &b, const double p[3]) {
+    if (b.shape != SHAPE_SPHERE)
+        return true;
+    double r2 = 0.0;
+    for (int a = 0; a < 3; a++)
+        r2 += (p[a] - b.origin[a]) * (p[a] - b.origin[a]);
+    return r2 <= b.size[0] * b.size[0];
+}
+
+// Counter-based random numbers, so jitter does not depend on the thread schedule
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static double uniform(uint64_t seed, uint64_t index, int component) {
+    uint64_t bits = splitmix64(seed * 0x100000001B3ull ^ (index * 3 + component));
+    return (bits >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+}
+
+static bool writeText(ThreadPool &pool, const std::string &path,
+                      const std::vector<float> &positions, double particleVolume,
+                      double particleMass) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        printf("Error: Cannot write particle file %s\n", path.c_str());
+        return false;
+    }
+    int64_t count = positions.size() / 3;
+    fprintf(fp, "%lld\n%.17g\n%.17g\n", (long long)count, particleVolume, particleMass);
+
+    // Format a batch of chunks in parallel, write them in order, repeat
+    int batchChunks = pool.getNumThreads() * 4;
+    std::vector<std::string> text(batchChunks);
+    bool ok = true;
+    for (int64_t batchStart = 0; batchStart < count && ok;
+         batchStart += (int64_t)batchChunks * TEXT_GRAIN) {
+        pool.parallelFor(batchChunks, 1, [&](int begin, int end, int thread) {
+            char line[64];
+            for (int c = begin; c < end; c++) {
+                text[c].clear();
+                int64_t first = batchStart + (int64_t)c * TEXT_GRAIN;
+                int64_t last = first + TEXT_GRAIN < count ? first + TEXT_GRAIN : count;
+                for (int64_t p = first; p < last; p++) {
+                    int len = snprintf(line, sizeof(line), "%.9g %.9g %.9g\n", positions[p * 3],
+                                       positions[p * 3 + 1], positions[p * 3 + 2]);
+                    text[c].append(line, len);
+                }
+            }
+        });
+        for (int c = 0; c < batchChunks && ok; c++)
+            ok = fwrite(text[c].data(), 1, text[c].size(), fp) == text[c].size();
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+        printf("Error: Failed writing particle file %s\n", path.c_str());
+    return ok;
+}
+
+static bool writeScene(const std::string &path, const std::string &particleFile) {
+    std::string scene;
+    FILE *in = fopen(SCENE_TEMPLATE, "rb");
+    if (!in) {
+        printf("Error: Cannot read scene template %s\n", SCENE_TEMPLATE);
+        return false;
+    }
+    char buffer[4096];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        scene.append(buffer, len);
+    fclose(in);
+
+    std::string key = "{{ filename }}";
+    size_t pos = scene.find(key);
+    if (pos != std::string::npos)
+        scene.replace(pos, key.size(), particleFile);
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        printf("Error: Cannot write scene file %s\n", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(scene.data(), 1, scene.size(), fp) == scene.size();
+    return (fclose(fp) == 0) && ok;
+}
+
+static void usage(const char *exe) {
+    printf("Usage: %s [-box ox oy oz sx sy sz] [-cube ox oy oz] [-sphere cx cy cz r] [-ppc p]\n"
+           "       [-n count] [-density d] [-jitter j] [-seed s] [-format dat|p2g] [-threads t]\n"
+           "       <name>\n",
+           exe);
+}
+
+int main(int argc, char **argv) {
+    std::vector<Block> blocks;
+    double ppc = 0.0;
+    double density = 1000.0;
+    double jitter = 0.0;
+    int64_t targetCount = 0;
+    uint64_t seed = 1;
+    int threads = 0;
+    bool binary = false;
+    std::string name;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        int params = 0;
+        if (arg == "-box")
+            params = 6;
+        else if (arg == "-cube")
+            params = 3;
+        else if (arg == "-sphere")
+            params = 4;
+        else if (arg == "-ppc" || arg == "-n" || arg == "-density" || arg == "-jitter" ||
+                 arg == "-seed" || arg == "-format" || arg == "-threads")
+            params = 1;
+        else if (arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            name = arg;
+            continue;
+        }
+        if (i + params >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (arg == "-box" || arg == "-cube" || arg == "-sphere") {
+            Block b;
+            memset(b.size, 0, sizeof(b.size));
+            b.shape = (arg == "-box") ? SHAPE_BOX : (arg == "-cube") ? SHAPE_CUBE : SHAPE_SPHERE;
+            for (int a = 0; a < 3; a++)
+                b.origin[a] = atof(argv[i + 1 + a]);
+            for (int a = 3; a < params; a++)
+                b.size[a - 3] = atof(argv[i + 1 + a]);
+            blocks.push_back(b);
+        } else if (arg == "-ppc") {
+            ppc = atof(argv[i + 1]);
+        } else if (arg == "-n") {
+            targetCount = atoll(argv[i + 1]);
+        } else if (arg == "-density") {
+            density = atof(argv[i + 1]);
+        } else if (arg == "-jitter") {
+            jitter = atof(argv[i + 1]);
+        } else if (arg == "-seed") {
+            seed = strtoull(argv[i + 1], 0, 10);
+        } else if (arg == "-format") {
+            binary = strcmp(argv[i + 1], "p2g") == 0;
+        } else if (arg == "-threads") {
+            threads = atoi(argv[i + 1]);
+        }
+        i += params;
+    }
+
+    if (name.empty() || blocks.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Two out of ppc, particle count and size, as in generate_particles_box_strided
+    double totalVolume = 0.0;
+    for (size_t b = 0; b < blocks.size(); b++) {
+        if (blocks[b].shape == SHAPE_CUBE) {
+            if (ppc <= 0.0 || targetCount <= 0 || blocks.size() != 1) {
+                printf("Error: -cube needs -ppc and -n and must be the only block\n");
+                return 1;
+            }
+            double side = pow(targetCount / ppc, 1.0 / 3.0);
+            blocks[b].size[0] = blocks[b].size[1] = blocks[b].size[2] = side;
+        }
+        totalVolume += blockVolume(blocks[b]);
+    }
+    if (ppc <= 0.0) {
+        if (targetCount <= 0) {
+            printf("Error: Specify -ppc or -n\n");
+            return 1;
+        }
+        ppc = targetCount / totalVolume;
+    }
+
+    // Particle volume follows the requested count, the lattice may hold a few more or less
+    // particles, like the Python generator
+    int64_t nominalCount = targetCount > 0 ? targetCount : (int64_t)(totalVolume * ppc);
+    double particleVolume = totalVolume / nominalCount; // cm^3
+    double stride = pow(particleVolume, 1.0 / 3.0);
+
+    ThreadPool pool(threads);
+
+    // Count particles per x slab, then fill every slab at its own offset
+    int64_t count = 0;
+    for (size_t b = 0; b < blocks.size(); b++) {
+        Block &block = blocks[b];
+        setupLattice(block, stride);
+        std::vector<int64_t> slabCount(block.steps[0], 0);
+        pool.parallelFor(block.steps[0], 1, [&](int begin, int end, int thread) {
+            double p[3];
+            for (int i = begin; i < end; i++) {
+                int64_t n = 0;
+                for (int j = 0; j < block.steps[1]; j++) {
+                    for (int k = 0; k < block.steps[2]; k++) {
+                        latticePoint(block, stride, i, j, k, p);
+                        n += inside(block, p);
+                    }
+                }
+                slabCount[i] = n;
+            }
+        });
+        block.slabStart.resize(block.steps[0]);
+        for (int i = 0; i < block.steps[0]; i++) {
+            block.slabStart[i] = count;
+            count += slabCount[i];
+        }
+    }
+    if (count == 0) {
+        printf("Error: Blocks contain no particles\n");
+        return 1;
+    }
+
+    std::vector<float> positions(count * 3);
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const Block &block = blocks[b];
+        pool.parallelFor(block.steps[0], 1, [&](int begin, int end, int thread) {
+            double p[3];
+            for (int i = begin; i < end; i++) {
+                int64_t index = block.slabStart[i];
+                for (int j = 0; j < block.steps[1]; j++) {
+                    for (int k = 0; k < block.steps[2]; k++) {
+                        latticePoint(block, stride, i, j, k, p);
+                        if (!inside(block, p))
+                            continue;
+                        for (int a = 0; a < 3; a++) {
+                            double offset = 0.0;
+                            if (jitter > 0.0)
+                                offset = (uniform(seed, index, a) - 0.5) * jitter * stride;
+                            positions[index * 3 + a] = (float)(p[a] + offset);
+                        }
+                        index++;
+                    }
+                }
+            }
+        });
+    }
+
+    double initialVolume = particleVolume * 1e-6;  // cm^3 to m^3
+    double mass = density * particleVolume * 1e-6; // kg
+
+    std::string particleFile = name + (binary ? ".p2g" : ".dat");
+    bool ok;
+    if (binary) {
+        ok = writeParticleFile(particleFile, count, (float)initialVolume, (float)mass,
+                               &positions[0], 0, 0, 0);
+    } else {
+        ok = writeText(pool, particleFile, positions, initialVolume, mass);
+    }
+    ok = ok && writeScene(name + ".scn", particleFile);
+    if (!ok)
+        return 1;
+
+    printf("\n%s\n", name.c_str());
+    printf("  Particle volume (m^3) : %g\n", initialVolume);
+    printf("  Particles per cell    : %g\n", ppc);
+    printf("  Particle mass (kg)    : %g\n", mass);
+    printf("  Particle count        : %lld\n", (long long)count);
+    printf("  Blocks                : %d\n", (int)blocks.size());
+    printf("  Threads               : %d\n", pool.getNumThreads());
+    return 0;
+}